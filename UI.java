@@ -11,9 +11,6 @@ import javax.swing.event.ChangeEvent;
 import javax.swing.event.ChangeListener;
 
 
-import java.io.File;
-import java.io.FileOutputStream;
-
 import java.util.Timer;
 import java.util.TimerTask;
 
@@ -141,7 +138,6 @@ public class UI extends JFrame {
         Thread t = new Thread() {
             byte []data = new byte[w*h*3];
             public void run(){
-                int counter = 0;
                 int frames_to_save = 0;
                 while(true) {
                     try {
@@ -155,20 +151,19 @@ public class UI extends JFrame {
                         synchronized(record) {
                             if(record) {
                                 recordings++;
+                                if(frames_to_save == 0)
+                                    camera.startRecording("/tmp/seq_" + recordings + ".ser",0);
                                 frames_to_save = 30*10;
-                                counter = 0;
                                 record=false;
                             }
                         }
-                        if(frames_to_save > 0) {
+                        if(frames_to_save > 0 && r != 0) {
                             frames_to_save --;
-                            counter++;
-                            //double ts = (System.currentTimeMillis() % (1000L * 3600 * 24))/ 1000.0;
-                            //File outputFile = new File("/tmp/seq_" + recordings + "_n_" + counter + "_" + ts + ".ppm");
-                            File outputFile = new File("/tmp/seq_" + recordings + "_n_" + counter + ".ppm");
-                            try (FileOutputStream outputStream = new FileOutputStream(outputFile)) {
-                                outputStream.write(("P6\n" + w + " " + h + " 255\n").getBytes());
-                                outputStream.write(data);
+                            if(frames_to_save == 0) {
+                                camera.stopRecording();
+                                UVC.UVCRecorderStats st = camera.getRecorderStats();
+                                System.out.println(String.format("Recorded %d frames, dropped %d, queue peak %d/%d, write stalls %d",
+                                    st.frames_written,st.frames_dropped,st.queue_high_water,st.queue_size,st.write_stalls));
                             }
                         }
                     }
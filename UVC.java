@@ -6,13 +6,21 @@ import com.sun.jna.Memory;
 import com.sun.jna.Callback;
 
 public class UVC {
+    public static final int FORMAT_YUYV = 0;
+    public static final int FORMAT_MJPEG = 1;
+    public static final int FORMAT_Y8 = 2;
+    public static final int FORMAT_Y16 = 3;
+    public static final int FORMAT_RGB = 4;
+    public static final int VIRTUAL_BENCHMARK = 1;
+    public static final int VIRTUAL_LOOP = 2;
+
     public interface FrameCallback {
         public void frame(int frame,byte[] data,int w,int h);
         public void error(int frame,String message);
     };
 
     public interface uvcctl_callback_type extends Callback {
-        public void invoke(Pointer p,int frame,Pointer data,int w,int h,int bpp,String error_message);
+        public void invoke(Pointer p,int frame,Pointer data,int w,int h,int bpp,long timestamp_us,int skipped,Pointer controls,String error_message);
     };
     public static class UVCLimits extends Structure {
         public static class ByReference extends UVCLimits implements Structure.ByReference {}
@@ -21,25 +29,69 @@ public class UVC {
         public int wb_temp_min;
         public int wb_temp_max;
     };
+    public static class UVCRecorderStats extends Structure {
+        public static class ByReference extends UVCRecorderStats implements Structure.ByReference {}
+        public int frames_written;
+        public int frames_dropped;
+        public int queue_size;
+        public int queue_high_water;
+        public int write_stalls;
+        public int failed;
+    };
+
+    public static class UVCStats extends Structure {
+        public static class ByReference extends UVCStats implements Structure.ByReference {}
+        public int frames_received;
+        public int frames_delivered;
+        public int frames_incomplete;
+        public int frames_dropped;
+        public int frames_failed;
+        public int transfer_retunes;
+        public long bytes_received;
+        public double convert_ms_avg;
+        public double convert_ms_max;
+        public int[] convert_hist = new int[20];
+        public int[] latency_hist = new int[20];
+    };
+
+    public static class UVCBandwidth extends Structure {
+        public static class ByReference extends UVCBandwidth implements Structure.ByReference {}
+        public int devices;
+        public int streams;
+        public double required_mb_per_sec;
+        public double measured_mb_per_sec;
+    };
 
     public interface uvcctl extends Library {
 
         String uvcctl_error(Pointer obj);
         Pointer uvcctl_create();
+        Pointer uvcctl_create_virtual(String source,int flags);
         int uvcctl_open_fd(String path);
         void uvcctl_close_fd(int id);
         void uvcctl_delete(Pointer obj);
         int uvcctl_open(Pointer obj,int fd,int[] sizes,int n);
-        void uvcctl_set_size(Pointer obj,int w,int h,int comp);
+        int uvcctl_get_sizes(Pointer obj,int format,int[] sizes,int n);
+        void uvcctl_set_size(Pointer obj,int w,int h,int format);
         void uvcctl_set_buffers(Pointer obj,int N,int size);
+        void uvcctl_get_buffers(Pointer obj,int[] N,int[] size);
+        void uvcctl_set_pool_size(Pointer obj,int N);
+        void uvcctl_set_latest_only(Pointer obj,int enable);
+        int uvcctl_get_dropped_frames(Pointer obj);
         int uvcctl_start_stream(Pointer obj,uvcctl_callback_type callback,Pointer user_data);
-        int uvcctl_read_frame(Pointer obj,int timeout_us,int w,int h,Pointer p);
+        int uvcctl_read_frame(Pointer obj,int timeout_us,int w,int h,Pointer p,Pointer info);
+        void uvcctl_get_stats(Pointer obj,UVCStats.ByReference stats);
+        void uvcctl_get_bandwidth(UVCBandwidth.ByReference bw);
         int uvcctl_stop_stream(Pointer obj);
+        int uvcctl_start_recording(Pointer obj,String path,int queue_frames);
+        int uvcctl_stop_recording(Pointer obj);
+        void uvcctl_get_recorder_stats(Pointer obj,UVCRecorderStats.ByReference stats);
         int uvcctl_auto_mode(Pointer obj,int isAuto);
         int uvcctl_get_control_limits(Pointer obj,UVCLimits.ByReference limits);
         int uvcctl_set_gain(Pointer obj,double range);
         int uvcctl_set_exposure(Pointer obj,double exp_ms);
         int uvcctl_set_wb(Pointer obj,int temperature);
+        int uvcctl_flush_controls(Pointer obj);
 
 
     };
@@ -50,6 +102,13 @@ public class UVC {
         obj = api.uvcctl_create();
         fd = -1;
     }
+    // replays SER/raw file or "synthetic" frames, device given to open is ignored
+    public UVC(String virtualSource,int flags)
+    {
+        api = (uvcctl)Native.loadLibrary("uvcctl",uvcctl.class); 
+        obj = api.uvcctl_create_virtual(virtualSource,flags);
+        fd = -1;
+    }
     public UVCLimits getLimits()  throws Exception
     {
         UVCLimits.ByReference lim = new UVCLimits.ByReference();
@@ -72,6 +131,11 @@ public class UVC {
     {
         check(api.uvcctl_set_wb(obj,temp),"set wb");
     }
+    // controls are applied in background, waits for pending ones
+    public void flushControls() throws Exception
+    {
+        check(api.uvcctl_flush_controls(obj),"flush controls");
+    }
 
     public int[] open(String path) throws Exception
     {
@@ -93,15 +157,50 @@ public class UVC {
             res[i] = sizes[i];
         return res;
     }
+    public int[] getSizes(int format) throws Exception
+    {
+        int[] sizes=new int[128];
+        int n = api.uvcctl_get_sizes(obj,format,sizes,64);
+        check(n,"get sizes");
+        int[] res = new int[n*2];
+        for(int i=0;i<n*2;i++)
+            res[i] = sizes[i];
+        return res;
+    }
     public void setFormat(int w,int h,boolean isCompressed)
     {
-        api.uvcctl_set_size(obj,w,h,isCompressed ? 1:0);
+        setFormat(w,h,isCompressed ? FORMAT_MJPEG : FORMAT_YUYV);
+    }
+    public void setFormat(int w,int h,int format)
+    {
+        api.uvcctl_set_size(obj,w,h,format);
         buffer = new Memory(w*h*3);
     }
     public void setBuffers(int count,int size)
     {
         api.uvcctl_set_buffers(obj,count,size);
     }
+    // count and size of transfer buffers in use
+    public int[] getBuffers()
+    {
+        int[] n = new int[1];
+        int[] size = new int[1];
+        api.uvcctl_get_buffers(obj,n,size);
+        return new int[]{n[0],size[0]};
+    }
+    public void setPoolSize(int count)
+    {
+        api.uvcctl_set_pool_size(obj,count);
+    }
+    // getFrame returns the newest frame dropping the older ones
+    public void setLatestOnly(boolean v)
+    {
+        api.uvcctl_set_latest_only(obj,v ? 1 : 0);
+    }
+    public int getDroppedFrames()
+    {
+        return api.uvcctl_get_dropped_frames(obj);
+    }
     public void stream() throws Exception
     {
         int res = api.uvcctl_start_stream(obj,null,null);
@@ -109,7 +208,7 @@ public class UVC {
     }
     public int getFrame(int timeout,int w,int h,byte[] data) throws Exception
     {
-        int r = api.uvcctl_read_frame(obj,timeout,w,h,buffer);
+        int r = api.uvcctl_read_frame(obj,timeout,w,h,buffer,null);
         check(r,"getFrame failed");
         if(r == 0)
             return 0;
@@ -121,6 +220,33 @@ public class UVC {
         int res = api.uvcctl_stop_stream(obj);
         check(res,"stop_stream");
     }
+    public void startRecording(String path,int queueFrames) throws Exception
+    {
+        check(api.uvcctl_start_recording(obj,path,queueFrames),"start recording");
+    }
+    public void stopRecording() throws Exception
+    {
+        check(api.uvcctl_stop_recording(obj),"stop recording");
+    }
+    public UVCStats getStats()
+    {
+        UVCStats.ByReference stats = new UVCStats.ByReference();
+        api.uvcctl_get_stats(obj,stats);
+        return stats;
+    }
+    // all cameras open in the process
+    public UVCBandwidth getBandwidth()
+    {
+        UVCBandwidth.ByReference bw = new UVCBandwidth.ByReference();
+        api.uvcctl_get_bandwidth(bw);
+        return bw;
+    }
+    public UVCRecorderStats getRecorderStats()
+    {
+        UVCRecorderStats.ByReference stats = new UVCRecorderStats.ByReference();
+        api.uvcctl_get_recorder_stats(obj,stats);
+        return stats;
+    }
     public void closeDevice()
     {
         api.uvcctl_delete(obj);
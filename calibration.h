@@ -0,0 +1,162 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+//
+// Calibration masters: bias, darks and flat fields. Masters are kept as captured, in [0,1]
+// before source gamma, and turned into linear offset and gain planes only when settings
+// change, so a frame is calibrated in a single pass
+//
+//   out = (linear(in) - offset) * gain
+//
+// offset is bias plus dark current scaled by exposure ratio, gain is the reciprocal of the
+// flat normalized per channel. Darks are scaled only if bias is known, otherwise they already
+// contain it and are subtracted as is. Masters closest to the frame gain, then exposure, are
+// used; negative exposure or gain means unknown and matches anything
+//
+class Calibration {
+public:
+    enum { BIAS, DARK, FLAT };
+    // flat pixels darker than this part of the channel mean are not amplified further
+    static constexpr float min_flat = 0.05f;
+
+    // master is CV_32F and kept without copying, the caller must not modify it afterwards
+    void add(int kind,cv::Mat master,float exposure_ms,float gain)
+    {
+        if(kind < BIAS || kind > FLAT)
+            throw std::runtime_error("Invalid master kind");
+        masters_[kind].push_back(Master{master,exposure_ms,gain});
+        dirty_ = true;
+    }
+    void clear(int kind)
+    {
+        masters_[kind].clear();
+        dirty_ = true;
+    }
+    void set_frame(float exposure_ms,float gain)
+    {
+        exposure_ms_ = exposure_ms;
+        gain_ = gain;
+        dirty_ = true;
+    }
+    float frame_exposure_ms() const
+    {
+        return exposure_ms_;
+    }
+    float frame_gain() const
+    {
+        return gain_;
+    }
+    // rebuilds offset and gain for source gamma if anything changed, not thread safe
+    void update(float gamma)
+    {
+        if(!dirty_ && gamma == gamma_)
+            return;
+        dirty_ = false;
+        gamma_ = gamma;
+        Master const *bias = pick(BIAS);
+        Master const *dark = pick(DARK);
+        Master const *flat = pick(FLAT);
+        cv::Mat bias_linear;
+        if(bias)
+            bias_linear = linear(bias->image);
+        if(dark) {
+            cv::Mat dark_linear = linear(dark->image);
+            if(bias && dark->exposure_ms > 0 && exposure_ms_ >= 0)
+                offset_ = bias_linear + (dark_linear - bias_linear) * (exposure_ms_ / dark->exposure_ms);
+            else
+                offset_ = dark_linear;
+        }
+        else if(bias) {
+            offset_ = bias_linear;
+        }
+        else {
+            offset_.release();
+        }
+        if(flat) {
+            cv::Mat f = linear(flat->image);
+            if(bias)
+                f -= bias_linear;
+            cv::Scalar mean = cv::mean(f);
+            gain_map_.create(f.rows,f.cols,f.type());
+            int ch = f.channels();
+            for(int r=0;r<f.rows;r++) {
+                float const *src = f.ptr<float>(r);
+                float *tgt = gain_map_.ptr<float>(r);
+                for(int i=0;i<f.cols*ch;i++) {
+                    float m = float(mean[i % ch]);
+                    tgt[i] = m / std::max(src[i],m * min_flat);
+                }
+            }
+        }
+        else {
+            gain_map_.release();
+        }
+    }
+    // out = (linear(in) - offset) * gain for row r of n samples, linear maps input samples
+    template<typename T,typename Linear>
+    void apply_row(int r,T const *__restrict in,Linear linear,float *__restrict out,int n) const
+    {
+        float const *__restrict o = offset_.empty() ? nullptr : offset_.ptr<float>(r);
+        float const *__restrict g = gain_map_.empty() ? nullptr : gain_map_.ptr<float>(r);
+        // separate loops keep each variant vectorizable
+        if(o && g) {
+            for(int i=0;i<n;i++)
+                out[i] = (linear(in[i]) - o[i]) * g[i];
+        }
+        else if(o) {
+            for(int i=0;i<n;i++)
+                out[i] = linear(in[i]) - o[i];
+        }
+        else if(g) {
+            for(int i=0;i<n;i++)
+                out[i] = linear(in[i]) * g[i];
+        }
+        else {
+            for(int i=0;i<n;i++)
+                out[i] = linear(in[i]);
+        }
+    }
+private:
+    struct Master {
+        cv::Mat image;
+        float exposure_ms;
+        float gain;
+    };
+    static float distance(float master,float frame)
+    {
+        return master < 0 || frame < 0 ? 0.0f : std::abs(master - frame);
+    }
+    Master const *pick(int kind) const
+    {
+        Master const *best = nullptr;
+        for(auto const &m : masters_[kind]) {
+            if(!best)
+                best = &m;
+            float dg = distance(m.gain,gain_) - distance(best->gain,gain_);
+            if(dg < 0 || (dg == 0 && distance(m.exposure_ms,exposure_ms_) < distance(best->exposure_ms,exposure_ms_)))
+                best = &m;
+        }
+        return best;
+    }
+    cv::Mat linear(cv::Mat const &m) const
+    {
+        cv::Mat res;
+        if(gamma_ == 1.0f)
+            res = m.clone();
+        else
+            cv::pow(m,gamma_,res);
+        return res;
+    }
+
+    std::vector<Master> masters_[3];
+    float exposure_ms_ = -1;
+    float gain_ = -1;
+    float gamma_ = 1.0f;
+    bool dirty_ = false;
+    cv::Mat offset_;
+    cv::Mat gain_map_;
+};
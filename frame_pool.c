@@ -0,0 +1,191 @@
+#include "frame_pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+static void ring_init(frame_ring *r)
+{
+    atomic_init(&r->head,0);
+    atomic_init(&r->tail,0);
+}
+
+static int ring_push(frame_ring *r,int value)
+{
+    unsigned head = atomic_load_explicit(&r->head,memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&r->tail,memory_order_acquire);
+    if(head - tail >= FRAME_POOL_MAX)
+        return -1;
+    r->items[head % FRAME_POOL_MAX] = value;
+    atomic_store_explicit(&r->head,head + 1,memory_order_release);
+    return 0;
+}
+
+static int ring_pop(frame_ring *r)
+{
+    unsigned tail = atomic_load_explicit(&r->tail,memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&r->head,memory_order_acquire);
+    if(head == tail)
+        return -1;
+    int value = r->items[tail % FRAME_POOL_MAX];
+    atomic_store_explicit(&r->tail,tail + 1,memory_order_release);
+    return value;
+}
+
+int frame_pool_init(frame_pool *p,int n,size_t buffer_size,int latest_only)
+{
+    int i;
+    memset(p,0,sizeof(*p));
+    if(n <= 0 || n > FRAME_POOL_MAX)
+        return -1;
+    p->memory = (char *)malloc(buffer_size * n);
+    if(!p->memory)
+        return -1;
+    if(sem_init(&p->ready,0,0) < 0) {
+        free(p->memory);
+        p->memory = NULL;
+        return -1;
+    }
+    p->size = n;
+    p->buffer_size = buffer_size;
+    p->latest_only = latest_only;
+    ring_init(&p->free_ring);
+    ring_init(&p->ready_ring);
+    ring_init(&p->spare_ring);
+    atomic_init(&p->latest,-1);
+    atomic_init(&p->dropped,0);
+    atomic_init(&p->users,0);
+    atomic_init(&p->stopped,0);
+    for(i=0;i<n;i++)
+        ring_push(&p->free_ring,i);
+    return 0;
+}
+
+void frame_pool_free(frame_pool *p)
+{
+    if(p->memory) {
+        frame_pool_stop(p);
+        while(atomic_load(&p->users) > 0) {
+            struct timespec ts = { 0, 1000000 };
+            nanosleep(&ts,NULL);
+        }
+        sem_destroy(&p->ready);
+        free(p->memory);
+        p->memory = NULL;
+    }
+    p->size = 0;
+}
+
+void frame_pool_stop(frame_pool *p)
+{
+    // consumers check stopped after registering in users, so either they see it or
+    // frame_pool_free waits for them
+    atomic_store(&p->stopped,1);
+    sem_post(&p->ready);
+}
+
+char *frame_pool_data(frame_pool *p,int slot)
+{
+    return p->memory + p->buffer_size * slot;
+}
+
+int frame_pool_get_free(frame_pool *p)
+{
+    int slot = ring_pop(&p->spare_ring);
+    if(slot < 0)
+        slot = ring_pop(&p->free_ring);
+    if(slot < 0)
+        frame_pool_count_drop(p);
+    return slot;
+}
+
+void frame_pool_count_drop(frame_pool *p)
+{
+    atomic_fetch_add_explicit(&p->dropped,1,memory_order_relaxed);
+}
+
+void frame_pool_put_ready(frame_pool *p,int slot)
+{
+    if(p->latest_only) {
+        // semaphore is posted only when latest becomes non empty, consumer empties it after wait
+        int prev = atomic_exchange(&p->latest,slot);
+        if(prev < 0) {
+            sem_post(&p->ready);
+        }
+        else {
+            ring_push(&p->spare_ring,prev);
+            frame_pool_count_drop(p);
+        }
+        return;
+    }
+    ring_push(&p->ready_ring,slot);
+    sem_post(&p->ready);
+}
+
+void frame_pool_recycle(frame_pool *p,int slot)
+{
+    ring_push(&p->spare_ring,slot);
+}
+
+static int leave_stopped(frame_pool *p)
+{
+    // passes the wake up on to the next blocked consumer
+    sem_post(&p->ready);
+    atomic_fetch_sub(&p->users,1);
+    return -2;
+}
+
+int frame_pool_get_ready(frame_pool *p,int timeout)
+{
+    int res,slot;
+    atomic_fetch_add(&p->users,1);
+    if(atomic_load(&p->stopped)) {
+        atomic_fetch_sub(&p->users,1);
+        return -2;
+    }
+    if(timeout < 0) {
+        res = sem_trywait(&p->ready);
+    }
+    else if(timeout == 0) {
+        while((res = sem_wait(&p->ready)) < 0 && errno == EINTR)
+            ;
+    }
+    else {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME,&ts);
+        ts.tv_sec += timeout / 1000000;
+        ts.tv_nsec += (long)(timeout % 1000000) * 1000;
+        if(ts.tv_nsec >= 1000000000) {
+            ts.tv_sec ++;
+            ts.tv_nsec -= 1000000000;
+        }
+        while((res = sem_timedwait(&p->ready,&ts)) < 0 && errno == EINTR)
+            ;
+    }
+    if(atomic_load(&p->stopped))
+        return leave_stopped(p);
+    if(res < 0) {
+        atomic_fetch_sub(&p->users,1);
+        return -1;
+    }
+    if(p->latest_only)
+        slot = atomic_exchange(&p->latest,-1);
+    else
+        slot = ring_pop(&p->ready_ring);
+    if(slot < 0) {
+        atomic_fetch_sub(&p->users,1);
+        return -1;
+    }
+    // consumer keeps its place in users until the slot is released
+    p->held[slot] = 1;
+    return slot;
+}
+
+void frame_pool_release(frame_pool *p,int slot)
+{
+    int held = p->held[slot];
+    p->held[slot] = 0;
+    ring_push(&p->free_ring,slot);
+    if(held)
+        atomic_fetch_sub(&p->users,1);
+}
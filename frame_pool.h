@@ -0,0 +1,81 @@
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+#include "uvc_control.h"
+
+// must be power of 2 so free running ring counters wrap correctly
+#define FRAME_POOL_MAX 16
+
+// single producer/single consumer ring of buffer indexes
+typedef struct frame_ring {
+    int items[FRAME_POOL_MAX];
+    atomic_uint head;
+    atomic_uint tail;
+} frame_ring;
+
+typedef struct frame_slot {
+    int frame_no;
+    int width;
+    int height;
+    int bytes_per_pixel;
+    int64_t timestamp;
+    int skipped;
+    char const *error;
+    uvcctl_controls controls;
+} frame_slot;
+
+//
+// Fixed set of frame buffers allocated once per stream. The USB thread takes
+// buffers from free_ring and hands filled ones over ready_ring, the consumer
+// returns them to free_ring. No locks and no allocations after init.
+//
+// Freeing the pool stops it: blocked consumers are woken and get -2, the pool is
+// released once every slot handed to consumers is returned.
+//
+// In latest only mode there is no queue: a new frame replaces the pending one
+// in latest, the replaced buffer goes to spare_ring and is reused by the producer
+// before free_ring, so the consumer always gets the newest frame
+//
+typedef struct frame_pool {
+    int size;
+    size_t buffer_size;
+    char *memory;
+    frame_slot slots[FRAME_POOL_MAX];
+    frame_ring free_ring;
+    frame_ring ready_ring;
+    frame_ring spare_ring;
+    atomic_int latest;
+    int latest_only;
+    sem_t ready;
+    atomic_int dropped;
+    // consumers waiting in frame_pool_get_ready or holding a slot, see frame_pool_free
+    atomic_int users;
+    atomic_int stopped;
+    char held[FRAME_POOL_MAX];
+} frame_pool;
+
+int frame_pool_init(frame_pool *p,int n,size_t buffer_size,int latest_only);
+// wakes consumers and waits until they return their slots, must not be called by a consumer
+// holding a slot
+void frame_pool_free(frame_pool *p);
+// producer gave up: consumers are woken and get -2 from now on, slots stay valid until free
+void frame_pool_stop(frame_pool *p);
+char *frame_pool_data(frame_pool *p,int slot);
+
+// producer side, -1 if pool is exhausted, the frame is counted as dropped
+int frame_pool_get_free(frame_pool *p);
+void frame_pool_count_drop(frame_pool *p);
+void frame_pool_put_ready(frame_pool *p,int slot);
+// returns unused buffer from producer side
+void frame_pool_recycle(frame_pool *p,int slot);
+
+// consumer side, timeout in us, 0 - wait forever, -1 - don't wait. Returns -1 on timeout,
+// -2 if the pool is stopped
+int frame_pool_get_ready(frame_pool *p,int timeout);
+void frame_pool_release(frame_pool *p,int slot);
+
+#endif
@@ -0,0 +1,169 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+//
+// Calibration master file: fixed little endian header followed by samples row by row with
+// interleaved channels. Samples are stored as half float, 16 bit or float and are in the
+// domain of the given gamma, i.e. stacked frames are stored as is and raw frames with gamma 1.
+// Files are mapped rather than read, data and header are protected by CRC32 (zlib polynomial).
+// Readers accept any header_size from the version they know, so fields can be appended
+//
+struct MasterHeader {
+    enum { FLOAT, HALF, UINT16 };
+    static constexpr char const *signature = "STKMSTR";
+    static constexpr uint32_t current_version = 1;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;       // offset of samples
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+    uint32_t sample_type;
+    uint32_t kind;              // Calibration::BIAS, DARK or FLAT
+    uint32_t frames;            // frames stacked into the master
+    float exposure_ms;          // negative - unknown
+    float gain;                 // negative - unknown
+    float temperature;          // sensor temperature in C, NaN - unknown
+    float gamma;
+    uint32_t data_crc;
+    uint32_t header_crc;        // of header_size bytes with this field zeroed
+
+    size_t sample_bytes() const
+    {
+        return sample_type == FLOAT ? 4 : 2;
+    }
+    size_t data_bytes() const
+    {
+        return size_t(width) * height * channels * sample_bytes();
+    }
+};
+static_assert(sizeof(MasterHeader) == 64,"Master header layout is fixed");
+
+inline uint32_t crc32(void const *data,size_t size,uint32_t crc = 0)
+{
+    static uint32_t const *table = [] {
+        static uint32_t t[256];
+        for(uint32_t i=0;i<256;i++) {
+            uint32_t c = i;
+            for(int k=0;k<8;k++)
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    unsigned char const *p = static_cast<unsigned char const *>(data);
+    crc = ~crc;
+    for(size_t i=0;i<size;i++)
+        crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// image is CV_32FC1 or CV_32FC3, geometry and sample_type are taken from header, the rest is
+// written as given. Values are clamped to [0,1] for UINT16
+inline void save_master(std::string const &path,cv::Mat const &image,MasterHeader header)
+{
+    memcpy(header.magic,MasterHeader::signature,sizeof(header.magic));
+    header.version = MasterHeader::current_version;
+    header.header_size = sizeof(MasterHeader);
+    header.width = image.cols;
+    header.height = image.rows;
+    header.channels = image.channels();
+    cv::Mat data;
+    switch(header.sample_type) {
+    case MasterHeader::FLOAT: data = image.isContinuous() ? image : image.clone(); break;
+    case MasterHeader::HALF: image.convertTo(data,CV_MAKETYPE(CV_16F,image.channels())); break;
+    case MasterHeader::UINT16: image.convertTo(data,CV_MAKETYPE(CV_16U,image.channels()),65535); break;
+    default: throw std::runtime_error("Invalid master sample type");
+    }
+    header.data_crc = crc32(data.data,header.data_bytes());
+    header.header_crc = 0;
+    header.header_crc = crc32(&header,sizeof(header));
+    std::ofstream f(path,std::ios::binary);
+    if(!f)
+        throw std::runtime_error("Failed to open master file " + path);
+    f.write(reinterpret_cast<char const *>(&header),sizeof(header));
+    f.write(reinterpret_cast<char const *>(data.data),header.data_bytes());
+    if(!f.flush())
+        throw std::runtime_error("Failed to write master file " + path);
+}
+
+// false if the file is not a master, throws if it is damaged. Returns CV_32F image of the file
+// geometry with stored gamma undone, i.e. samples as captured
+inline bool load_master(std::string const &path,MasterHeader &header,cv::Mat &image)
+{
+    int fd = open(path.c_str(),O_RDONLY);
+    if(fd < 0)
+        throw std::runtime_error("Failed to open master file " + path);
+    struct stat st;
+    if(fstat(fd,&st) < 0 || size_t(st.st_size) < sizeof(MasterHeader)) {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    void *addr = mmap(nullptr,size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if(addr == MAP_FAILED)
+        throw std::runtime_error("Failed to map " + path);
+    // samples are read once, row by row
+    madvise(addr,size,MADV_SEQUENTIAL);
+    struct Unmap {
+        void *addr;
+        size_t size;
+        ~Unmap() { munmap(addr,size); }
+    } unmap{addr,size};
+    unsigned char const *base = static_cast<unsigned char const *>(addr);
+    memcpy(&header,base,sizeof(header));
+    if(memcmp(header.magic,MasterHeader::signature,sizeof(header.magic)) != 0)
+        return false;
+    if(header.version > MasterHeader::current_version || header.header_size < sizeof(MasterHeader) || header.header_size > size)
+        throw std::runtime_error("Unsupported master file version " + path);
+    uint32_t expected = header.header_crc;
+    MasterHeader zeroed = header;
+    zeroed.header_crc = 0;
+    uint32_t crc = crc32(&zeroed,sizeof(zeroed));
+    crc = crc32(base + sizeof(zeroed),header.header_size - sizeof(zeroed),crc);
+    if(crc != expected)
+        throw std::runtime_error("Corrupted master file header " + path);
+    if(header.width == 0 || header.height == 0 || (header.channels != 1 && header.channels != 3) || header.sample_type > MasterHeader::UINT16)
+        throw std::runtime_error("Invalid master file " + path);
+    if(size - header.header_size < header.data_bytes())
+        throw std::runtime_error("Master file is too short " + path);
+    if(!(header.gamma > 0))
+        throw std::runtime_error("Invalid master gamma " + path);
+    // checksum, conversion and gamma of each row while it is in cache, straight into the
+    // image that is kept
+    unsigned char const *samples = base + header.header_size;
+    int depth = header.sample_type == MasterHeader::FLOAT ? CV_32F : (header.sample_type == MasterHeader::HALF ? CV_16F : CV_16U);
+    double scale = header.sample_type == MasterHeader::UINT16 ? 1 / 65535.0 : 1.0;
+    int n = header.width * header.channels;
+    size_t row_bytes = n * header.sample_bytes();
+    float inv_gamma = 1 / header.gamma;
+    image.create(header.height,header.width,CV_MAKETYPE(CV_32F,header.channels));
+    uint32_t data_crc = 0;
+    for(uint32_t r=0;r<header.height;r++) {
+        unsigned char const *src = samples + row_bytes * r;
+        data_crc = crc32(src,row_bytes,data_crc);
+        cv::Mat row = image.row(r).reshape(1,1);
+        cv::Mat(1,n,depth,const_cast<unsigned char *>(src)).convertTo(row,CV_32F,scale);
+        if(header.gamma != 1.0f) {
+            float *v = row.ptr<float>();
+            for(int i=0;i<n;i++)
+                v[i] = std::pow(std::max(v[i],0.0f),inv_gamma);
+        }
+    }
+    if(data_crc != header.data_crc)
+        throw std::runtime_error("Corrupted master file data " + path);
+    return true;
+}
@@ -0,0 +1,224 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// geometry of SER recording, see ser_writer.h
+struct SerHeader {
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    int bytes_per_sample = 0;
+    int frames = 0;
+    static constexpr size_t size = 178;
+};
+
+// 16 bit data is assumed to be little endian as in virtual_camera.c
+inline SerHeader read_ser_header(std::string const &path)
+{
+    unsigned char h[SerHeader::size];
+    int fd = open(path.c_str(),O_RDONLY);
+    if(fd < 0)
+        throw std::runtime_error("Failed to open " + path);
+    ssize_t n = pread(fd,h,sizeof(h),0);
+    close(fd);
+    if(n != ssize_t(sizeof(h)))
+        throw std::runtime_error("Failed to read SER header of " + path);
+    auto le = [&](int pos) { return int(h[pos] | (h[pos+1] << 8) | (h[pos+2] << 16) | (unsigned(h[pos+3]) << 24)); };
+    SerHeader s;
+    int color_id = le(18);
+    int bits = le(34);
+    s.width = le(26);
+    s.height = le(30);
+    s.frames = le(38);
+    s.bytes_per_sample = bits <= 8 ? 1 : 2;
+    if(color_id == 0)
+        s.channels = 1;
+    else if(color_id == 100 && bits <= 8)
+        s.channels = 3;
+    else
+        throw std::runtime_error("Unsupported SER color format of " + path);
+    if(s.width <= 0 || s.height <= 0 || s.frames <= 0)
+        throw std::runtime_error("Invalid SER file " + path);
+    return s;
+}
+
+//
+// Per pixel median (or any percentile) of many frames without keeping them in memory.
+// Frames are processed in bands of rows: the band of every frame is gathered into one block,
+// samples are selected in parallel chunks and the next band follows, so memory is set by
+// block size rather than frame count. Files are memory mapped and pages of finished bands
+// are released. 8 bit samples are selected from counting histograms, 16 bit by nth_element
+//
+class MedianStacker {
+public:
+    // channels 1 or 3, 1 or 2 bytes per sample, block_bytes bounds one band of all frames
+    MedianStacker(int width,int height,int channels,int bytes_per_sample,size_t block_bytes = 32 << 20) :
+        width_(width),
+        height_(height),
+        channels_(channels),
+        bytes_per_sample_(bytes_per_sample),
+        block_bytes_(block_bytes)
+    {
+        if(width <= 0 || height <= 0 || (channels != 1 && channels != 3) || (bytes_per_sample != 1 && bytes_per_sample != 2))
+            throw std::runtime_error("Invalid median frame format");
+    }
+    size_t frame_bytes() const
+    {
+        return row_bytes() * height_;
+    }
+    int frames() const
+    {
+        return frames_.size();
+    }
+    // frame is used in place and must stay valid until compute
+    void add_frame(void const *data)
+    {
+        frames_.push_back(static_cast<unsigned char const *>(data));
+        mapped_.push_back(false);
+    }
+    // frames stored back to back from offset, the file is mapped, not read
+    void add_file(std::string const &path,size_t offset,int frames)
+    {
+        int fd = open(path.c_str(),O_RDONLY);
+        if(fd < 0)
+            throw std::runtime_error("Failed to open " + path);
+        struct stat st;
+        size_t size = offset + frame_bytes() * frames;
+        if(fstat(fd,&st) < 0 || size_t(st.st_size) < size) {
+            close(fd);
+            throw std::runtime_error("File is too short " + path);
+        }
+        void *addr = mmap(nullptr,size,PROT_READ,MAP_PRIVATE,fd,0);
+        close(fd);
+        if(addr == MAP_FAILED)
+            throw std::runtime_error("Failed to map " + path);
+        // frames are read band by band, one pass over each
+        madvise(addr,size,MADV_SEQUENTIAL);
+        mappings_.emplace_back(new Mapping(addr,size));
+        unsigned char const *base = static_cast<unsigned char const *>(addr) + offset;
+        for(int i=0;i<frames;i++) {
+            frames_.push_back(base + frame_bytes() * i);
+            mapped_.push_back(true);
+        }
+    }
+    void add_ser(std::string const &path)
+    {
+        SerHeader s = read_ser_header(path);
+        if(s.width != width_ || s.height != height_ || s.channels != channels_ || s.bytes_per_sample != bytes_per_sample_)
+            throw std::runtime_error("SER format does not match " + path);
+        add_file(path,SerHeader::size,s.frames);
+    }
+    // percentile in [0,100], 50 - median. out has the layout of input frames
+    void compute(float percentile,void *out)
+    {
+        int N = frames_.size();
+        if(N == 0)
+            throw std::runtime_error("No frames for median");
+        int rank = std::max(0,std::min(N - 1,int(std::lround(percentile / 100.0 * (N - 1)))));
+        size_t row = row_bytes();
+        int band = int(std::max<size_t>(1,std::min<size_t>(height_,block_bytes_ / (row * N))));
+        std::vector<unsigned char> block(row * band * N);
+        unsigned char *dst = static_cast<unsigned char *>(out);
+        long page = sysconf(_SC_PAGESIZE);
+        for(int y=0;y<height_;y+=band) {
+            int rows = std::min(band,height_ - y);
+            size_t bytes = row * rows;
+            for(int i=0;i<N;i++)
+                memcpy(block.data() + bytes * i,frames_[i] + row * y,bytes);
+            size_t samples = bytes / bytes_per_sample_;
+            int chunks = int((samples + chunk - 1) / chunk);
+            cv::parallel_for_(cv::Range(0,chunks),[&](cv::Range const &range) {
+                if(bytes_per_sample_ == 1)
+                    select8(block.data(),bytes,N,rank,range,dst + row * y);
+                else
+                    select16(block.data(),bytes,N,rank,range,dst + row * y);
+            });
+            // mapped pages of this band are not needed anymore, keeps resident memory bounded
+            for(int i=0;i<N;i++) {
+                if(!mapped_[i])
+                    continue;
+                uintptr_t start = (uintptr_t(frames_[i] + row * y) + page - 1) / page * page;
+                uintptr_t end = uintptr_t(frames_[i] + row * y + bytes) / page * page;
+                if(end > start)
+                    madvise(reinterpret_cast<void *>(start),end - start,MADV_DONTNEED);
+            }
+        }
+    }
+private:
+    // samples selected together, their 8 bit histograms take 64 KB and stay in L2 cache
+    static constexpr int chunk = 64;
+
+    struct Mapping {
+        Mapping(void *a,size_t s) : addr(a),size(s) {}
+        ~Mapping() { munmap(addr,size); }
+        void *addr;
+        size_t size;
+    };
+
+    size_t row_bytes() const
+    {
+        return size_t(width_) * channels_ * bytes_per_sample_;
+    }
+    // block holds N bands of bytes each, samples of range of chunks are written to out
+    static void select8(unsigned char const *block,size_t bytes,int N,int rank,cv::Range range,unsigned char *out)
+    {
+        // zeroed once, afterwards only the bins a chunk touched are cleared
+        std::vector<int> hist(chunk * 256);
+        for(int c=range.start;c<range.end;c++) {
+            size_t first = size_t(c) * chunk;
+            int n = int(std::min<size_t>(chunk,bytes - first));
+            for(int i=0;i<N;i++) {
+                unsigned char const *src = block + bytes * i + first;
+                for(int k=0;k<n;k++)
+                    hist[k * 256 + src[k]]++;
+            }
+            for(int k=0;k<n;k++) {
+                int const *h = hist.data() + k * 256;
+                int sum = 0;
+                int v = 0;
+                while((sum += h[v]) <= rank)
+                    v++;
+                out[first + k] = v;
+            }
+            for(int i=0;i<N;i++) {
+                unsigned char const *src = block + bytes * i + first;
+                for(int k=0;k<n;k++)
+                    hist[k * 256 + src[k]] = 0;
+            }
+        }
+    }
+    static void select16(unsigned char const *block,size_t bytes,int N,int rank,cv::Range range,unsigned char *out)
+    {
+        std::vector<unsigned short> values(N);
+        size_t samples = bytes / 2;
+        for(int c=range.start;c<range.end;c++) {
+            size_t first = size_t(c) * chunk;
+            size_t last = std::min(samples,first + chunk);
+            for(size_t k=first;k<last;k++) {
+                for(int i=0;i<N;i++)
+                    memcpy(&values[i],block + bytes * i + k * 2,2);
+                std::nth_element(values.begin(),values.begin() + rank,values.end());
+                memcpy(out + k * 2,&values[rank],2);
+            }
+        }
+    }
+
+    int width_;
+    int height_;
+    int channels_;
+    int bytes_per_sample_;
+    size_t block_bytes_;
+    std::vector<unsigned char const *> frames_;
+    std::vector<bool> mapped_;
+    std::vector<std::unique_ptr<Mapping>> mappings_;
+};
@@ -0,0 +1,195 @@
+#include "mjpeg_decoder.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <time.h>
+#include <jpeglib.h>
+
+typedef struct mjpeg_error_mgr {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+} mjpeg_error_mgr;
+
+static int64_t monotonic_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void error_exit(j_common_ptr cinfo)
+{
+    mjpeg_error_mgr *err = (mjpeg_error_mgr *)cinfo->err;
+    longjmp(err->jump,1);
+}
+
+static void output_message(j_common_ptr cinfo)
+{
+    // corrupt data warnings are common for MJPEG streams, don't flood the log
+    (void)cinfo;
+}
+
+//
+// UVC cameras usually omit DHT segments, libjpeg-turbo installs the
+// standard Huffman tables in that case so no table insertion is needed
+//
+static char const *decode(struct jpeg_decompress_struct *cinfo,mjpeg_error_mgr *err,mjpeg_job *job)
+{
+    if(setjmp(err->jump)) {
+        jpeg_abort_decompress(cinfo);
+        return "MJPEG decoding failed";
+    }
+    jpeg_mem_src(cinfo,job->jpeg,job->jpeg_size);
+    jpeg_read_header(cinfo,TRUE);
+    if((int)cinfo->image_width != job->width || (int)cinfo->image_height != job->height) {
+        jpeg_abort_decompress(cinfo);
+        return "MJPEG frame size does not match stream";
+    }
+    if((size_t)job->width * job->height * 3 > job->out_size) {
+        jpeg_abort_decompress(cinfo);
+        return "Frame is larger than pool buffer";
+    }
+    cinfo->out_color_space = JCS_RGB;
+    cinfo->dct_method = JDCT_IFAST;
+    jpeg_start_decompress(cinfo);
+    while(cinfo->output_scanline < cinfo->output_height) {
+        JSAMPROW row = job->out + (size_t)cinfo->output_scanline * job->width * 3;
+        jpeg_read_scanlines(cinfo,&row,1);
+    }
+    jpeg_finish_decompress(cinfo);
+    return NULL;
+}
+
+// called with lock held, only one thread delivers at a time to keep frame order
+static void deliver_ready(mjpeg_decoder *d)
+{
+    if(d->delivering)
+        return;
+    d->delivering = 1;
+    while(d->deliver_seq != d->take_seq) {
+        mjpeg_job *job = &d->jobs[d->deliver_seq % d->depth];
+        if(!job->done)
+            break;
+        pthread_mutex_unlock(&d->lock);
+        d->deliver(d->user_data,job->slot,job->frame_no,job->width,job->height,job->timestamp,job->decode_us,job->error);
+        pthread_mutex_lock(&d->lock);
+        job->done = 0;
+        d->deliver_seq++;
+    }
+    d->delivering = 0;
+}
+
+static void *worker(void *ptr)
+{
+    mjpeg_decoder *d = (mjpeg_decoder *)ptr;
+    struct jpeg_decompress_struct cinfo;
+    mjpeg_error_mgr err;
+    cinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = error_exit;
+    err.pub.output_message = output_message;
+    jpeg_create_decompress(&cinfo);
+
+    pthread_mutex_lock(&d->lock);
+    for(;;) {
+        while(!d->stop && d->take_seq == d->submit_seq)
+            pthread_cond_wait(&d->work,&d->lock);
+        if(d->stop)
+            break;
+        mjpeg_job *job = &d->jobs[d->take_seq % d->depth];
+        d->take_seq++;
+        pthread_mutex_unlock(&d->lock);
+        if(!job->error) {
+            int64_t start = monotonic_us();
+            job->error = decode(&cinfo,&err,job);
+            job->decode_us = monotonic_us() - start;
+        }
+        pthread_mutex_lock(&d->lock);
+        job->done = 1;
+        deliver_ready(d);
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    jpeg_destroy_decompress(&cinfo);
+    return NULL;
+}
+
+int mjpeg_decoder_init(mjpeg_decoder *d,int threads,int depth,size_t max_jpeg_size,mjpeg_deliver_type deliver,void *user_data)
+{
+    int i;
+    memset(d,0,sizeof(*d));
+    if(threads <= 0 || threads > MJPEG_MAX_THREADS || depth <= 0 || depth > MJPEG_MAX_DEPTH)
+        return -1;
+    d->memory = (unsigned char *)malloc(max_jpeg_size * depth);
+    if(!d->memory)
+        return -1;
+    for(i=0;i<depth;i++)
+        d->jobs[i].jpeg = d->memory + max_jpeg_size * i;
+    d->depth = depth;
+    d->max_jpeg_size = max_jpeg_size;
+    d->deliver = deliver;
+    d->user_data = user_data;
+    pthread_mutex_init(&d->lock,NULL);
+    pthread_cond_init(&d->work,NULL);
+    for(i=0;i<threads;i++) {
+        if(pthread_create(&d->threads[i],NULL,worker,d) != 0) {
+            mjpeg_decoder_free(d);
+            return -1;
+        }
+        d->threads_N++;
+    }
+    return 0;
+}
+
+int mjpeg_decoder_submit(mjpeg_decoder *d,void const *jpeg,size_t size,int frame_no,int width,int height,int64_t timestamp,
+                         int slot,unsigned char *out,size_t out_size,char const *error)
+{
+    pthread_mutex_lock(&d->lock);
+    if(d->submit_seq - d->deliver_seq >= (unsigned)d->depth) {
+        pthread_mutex_unlock(&d->lock);
+        return -1;
+    }
+    mjpeg_job *job = &d->jobs[d->submit_seq % d->depth];
+    pthread_mutex_unlock(&d->lock);
+
+    // the job is not visible to workers until submit_seq is advanced
+    if(!error && size > d->max_jpeg_size)
+        error = "Compressed frame is larger than decoder buffer";
+    if(!error)
+        memcpy(job->jpeg,jpeg,size);
+    job->jpeg_size = size;
+    job->frame_no = frame_no;
+    job->width = width;
+    job->height = height;
+    job->timestamp = timestamp;
+    job->decode_us = 0;
+    job->slot = slot;
+    job->out = out;
+    job->out_size = out_size;
+    job->error = error;
+    job->done = 0;
+
+    pthread_mutex_lock(&d->lock);
+    d->submit_seq++;
+    pthread_cond_signal(&d->work);
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+}
+
+void mjpeg_decoder_free(mjpeg_decoder *d)
+{
+    int i;
+    if(!d->memory)
+        return;
+    pthread_mutex_lock(&d->lock);
+    d->stop = 1;
+    pthread_cond_broadcast(&d->work);
+    pthread_mutex_unlock(&d->lock);
+    for(i=0;i<d->threads_N;i++)
+        pthread_join(d->threads[i],NULL);
+    d->threads_N = 0;
+    pthread_cond_destroy(&d->work);
+    pthread_mutex_destroy(&d->lock);
+    free(d->memory);
+    d->memory = NULL;
+}
@@ -0,0 +1,60 @@
+#ifndef MJPEG_DECODER_H
+#define MJPEG_DECODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define MJPEG_MAX_THREADS 8
+#define MJPEG_MAX_DEPTH 16
+
+// called in frame order from one thread at a time, error is NULL on success.
+// timestamp is passed through from submit, decode_us is time spent in libjpeg
+typedef void (*mjpeg_deliver_type)(void *user_data,int slot,int frame_no,int width,int height,int64_t timestamp,int decode_us,char const *error);
+
+typedef struct mjpeg_job {
+    unsigned char *jpeg;
+    size_t jpeg_size;
+    int frame_no;
+    int width;
+    int height;
+    int64_t timestamp;
+    int decode_us;
+    int slot;
+    unsigned char *out;
+    size_t out_size;
+    char const *error;
+    int done;
+} mjpeg_job;
+
+//
+// Pool of libjpeg decoders. Frames are submitted from the USB thread into a ring of
+// depth jobs with preallocated compressed buffers, decoded in parallel and delivered in
+// submission order
+//
+typedef struct mjpeg_decoder {
+    int threads_N;
+    pthread_t threads[MJPEG_MAX_THREADS];
+    int depth;
+    size_t max_jpeg_size;
+    unsigned char *memory;
+    mjpeg_job jobs[MJPEG_MAX_DEPTH];
+    unsigned submit_seq;
+    unsigned take_seq;
+    unsigned deliver_seq;
+    int delivering;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    mjpeg_deliver_type deliver;
+    void *user_data;
+} mjpeg_decoder;
+
+int mjpeg_decoder_init(mjpeg_decoder *d,int threads,int depth,size_t max_jpeg_size,mjpeg_deliver_type deliver,void *user_data);
+// returns -1 if the queue is full, if error is not NULL the frame is delivered as failed in order
+int mjpeg_decoder_submit(mjpeg_decoder *d,void const *jpeg,size_t size,int frame_no,int width,int height,int64_t timestamp,
+                         int slot,unsigned char *out,size_t out_size,char const *error);
+// frames in progress are completed, queued frames are discarded
+void mjpeg_decoder_free(mjpeg_decoder *d);
+
+#endif
@@ -0,0 +1,221 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <opencv2/core/hal/hal.hpp>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// parabola vertex through the peak and its two neighbours, offset in [-0.5,0.5]
+inline float parabolic_offset(float left,float center,float right)
+{
+    float d = left - 2 * center + right;
+    if(d >= 0)
+        return 0;
+    return std::max(-0.5f,std::min(0.5f,0.5f * (left - right) / d));
+}
+
+//
+// Phase correlation of square ROI against a reference. Transforms are real to packed
+// complex (CCS) with plans created once per window size, the window is zero padded
+// to the optimal DFT size and weighted by Hann window. Low pass filter and cross power normalization are done in
+// a single pass over the packed spectrum. No allocations after init.
+//
+// With decimation > 1 the ROI covers size*decimation pixels averaged in blocks while
+// reading, shifts are in decimated pixels. Low pass radius is fft_size * decimation / low_pass
+//
+class PhaseCorrelator {
+public:
+    void init(int size,int decimation = 1,int low_pass = 16)
+    {
+        size_ = size;
+        decimation_ = decimation;
+        fft_size_ = cv::getOptimalDFTSize(size);
+        // packed layout is handled for even sizes only
+        while(fft_size_ % 2 != 0)
+            fft_size_ = cv::getOptimalDFTSize(fft_size_ + 1);
+        // decimated ROI is already low passed, the same radius would leave too few
+        // frequencies to tell the peak from noise
+        radius_ = fft_size_ * decimation / low_pass;
+        // window suppresses ROI edges, they bias sub pixel estimation
+        window_.resize(size_);
+        for(int i=0;i<size_;i++)
+            window_[i] = size_ > 1 ? float(0.5 - 0.5 * std::cos(2 * CV_PI * i / (size_ - 1))) : 1.0f;
+        input_ = cv::Mat::zeros(fft_size_,fft_size_,CV_32F);
+        reference_.create(fft_size_,fft_size_,CV_32F);
+        spectrum_.create(fft_size_,fft_size_,CV_32F);
+        surface_.create(fft_size_,fft_size_,CV_32F);
+        int flags = CV_HAL_DFT_IS_CONTINUOUS;
+        // only the first size rows of padded input are non zero
+        forward_ = cv::hal::DFT2D::create(fft_size_,fft_size_,CV_32F,1,1,flags,size_);
+        inverse_ = cv::hal::DFT2D::create(fft_size_,fft_size_,CV_32F,1,1,flags | CV_HAL_DFT_INVERSE,0);
+    }
+    int size() const
+    {
+        return size_;
+    }
+    int fft_size() const
+    {
+        return fft_size_;
+    }
+    // frame is CV_32FC1 or CV_32FC3, green channel is used for RGB, roi is top left corner of
+    // size*decimation square
+    void set_reference(cv::Mat const &frame,cv::Point roi)
+    {
+        transform(frame,roi,reference_);
+    }
+    // reference kept outside, for many ROI sharing one correlator
+    void transform_reference(cv::Mat const &frame,cv::Point roi,cv::Mat &reference)
+    {
+        reference.create(fft_size_,fft_size_,CV_32F);
+        transform(frame,roi,reference);
+    }
+    // reference of other correlator of the same size, each thread needs its own correlator
+    void copy_reference(PhaseCorrelator const &other)
+    {
+        other.reference_.copyTo(reference_);
+    }
+    // sub pixel shift, see find_peak
+    cv::Point2f find_shift(cv::Mat const &frame,cv::Point roi)
+    {
+        return find_shift(frame,roi,reference_);
+    }
+    cv::Point2f find_shift(cv::Mat const &frame,cv::Point roi,cv::Mat const &reference)
+    {
+        transform(frame,roi,spectrum_);
+        cross_power(reference);
+        inverse_->apply(spectrum_.data,spectrum_.step,surface_.data,surface_.step);
+        return find_peak();
+    }
+private:
+    int fft_pos(int x) const
+    {
+        if(x > fft_size_ / 2)
+            return x - fft_size_;
+        else
+            return x;
+    }
+    void transform(cv::Mat const &frame,cv::Point roi,cv::Mat &spectrum)
+    {
+        int channels = frame.channels();
+        int channel = channels == 1 ? 0 : 1;
+        int d = decimation_;
+        double sum = 0;
+        for(int r=0;r<size_;r++) {
+            float *tgt = input_.ptr<float>(r);
+            if(d == 1) {
+                float const *src = frame.ptr<float>(roi.y + r) + roi.x * channels + channel;
+                for(int c=0;c<size_;c++)
+                    tgt[c] = src[c * channels];
+            }
+            else {
+                for(int c=0;c<size_;c++)
+                    tgt[c] = 0;
+                for(int i=0;i<d;i++) {
+                    float const *src = frame.ptr<float>(roi.y + r * d + i) + roi.x * channels + channel;
+                    for(int c=0;c<size_ * d;c++)
+                        tgt[c / d] += src[c * channels];
+                }
+                for(int c=0;c<size_;c++)
+                    tgt[c] *= 1.0f / (d * d);
+            }
+            for(int c=0;c<size_;c++)
+                sum += tgt[c];
+        }
+        // mean is removed so zero padding does not add a step at ROI edges
+        float mean = float(sum / (double(size_) * size_));
+        for(int r=0;r<size_;r++) {
+            float *tgt = input_.ptr<float>(r);
+            float wy = window_[r];
+            for(int c=0;c<size_;c++)
+                tgt[c] = (tgt[c] - mean) * wy * window_[c];
+        }
+        forward_->apply(input_.data,input_.step,spectrum.data,spectrum.step);
+    }
+    static void normalize_real(float a,float &b,bool pass)
+    {
+        float v = a * b;
+        b = (pass && v != 0) ? (v > 0 ? 1.0f : -1.0f) : 0.0f;
+    }
+    // reference * conj(frame) / |reference * conj(frame)|, zero outside of low pass radius
+    static void normalize_complex(float const *a,float *b,bool pass)
+    {
+        float re = a[0] * b[0] + a[1] * b[1];
+        float im = a[1] * b[0] - a[0] * b[1];
+        float mag = std::sqrt(re * re + im * im);
+        if(pass && mag > 0) {
+            b[0] = re / mag;
+            b[1] = im / mag;
+        }
+        else {
+            b[0] = b[1] = 0;
+        }
+    }
+    void cross_power(cv::Mat const &reference)
+    {
+        int n = fft_size_;
+        int half = n / 2;
+        int r2 = radius_ * radius_;
+        for(int r=0;r<n;r++) {
+            float const *a = reference.ptr<float>(r);
+            float *b = spectrum_.ptr<float>(r);
+            int ky = fft_pos(r);
+            // columns 1..n-2 hold (re,im) pairs of horizontal frequencies 1..n/2-1
+            for(int c=1;c<n-1;c+=2) {
+                int kx = (c + 1) / 2;
+                normalize_complex(a + c,b + c,kx*kx + ky*ky <= r2);
+            }
+        }
+        // first and last columns are horizontal frequencies 0 and n/2 packed vertically:
+        // real at row 0, (re,im) pairs of vertical frequencies 1..n/2-1, real at row n-1
+        for(int i=0;i<2;i++) {
+            int c = i == 0 ? 0 : n - 1;
+            int kx = i == 0 ? 0 : half;
+            normalize_real(reference.at<float>(0,c),spectrum_.at<float>(0,c),kx*kx <= r2);
+            normalize_real(reference.at<float>(n-1,c),spectrum_.at<float>(n-1,c),kx*kx + half*half <= r2);
+            for(int r=1;r<n-1;r+=2) {
+                int ky = (r + 1) / 2;
+                float a[2] = { reference.at<float>(r,c), reference.at<float>(r+1,c) };
+                float b[2] = { spectrum_.at<float>(r,c), spectrum_.at<float>(r+1,c) };
+                normalize_complex(a,b,kx*kx + ky*ky <= r2);
+                spectrum_.at<float>(r,c) = b[0];
+                spectrum_.at<float>(r+1,c) = b[1];
+            }
+        }
+    }
+    // shifts larger than half of the window are not meaningful for padded window,
+    // integer peak is refined using only its 4 neighbours of the periodic surface
+    cv::Point2f find_peak()
+    {
+        int n = fft_size_;
+        int limit = size_ / 2;
+        float max_v = -1e30f;
+        int pr = 0,pc = 0;
+        for(int r=0;r<n;r++) {
+            if(std::abs(fft_pos(r)) > limit)
+                continue;
+            float const *row = surface_.ptr<float>(r);
+            for(int c=0;c<n;c++) {
+                if(row[c] > max_v && std::abs(fft_pos(c)) <= limit) {
+                    max_v = row[c];
+                    pr = r;
+                    pc = c;
+                }
+            }
+        }
+        float ox = parabolic_offset(surface_.at<float>(pr,(pc + n - 1) % n),max_v,surface_.at<float>(pr,(pc + 1) % n));
+        float oy = parabolic_offset(surface_.at<float>((pr + n - 1) % n,pc),max_v,surface_.at<float>((pr + 1) % n,pc));
+        return cv::Point2f(fft_pos(pc) + ox,fft_pos(pr) + oy);
+    }
+
+    int size_ = 0;
+    int decimation_ = 1;
+    int fft_size_ = 0;
+    int radius_ = 0;
+    std::vector<float> window_;
+    cv::Mat input_;
+    cv::Mat reference_;
+    cv::Mat spectrum_;
+    cv::Mat surface_;
+    cv::Ptr<cv::hal::DFT2D> forward_;
+    cv::Ptr<cv::hal::DFT2D> inverse_;
+};
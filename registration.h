@@ -0,0 +1,209 @@
+#pragma once
+#include "phase_correlation.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+// expected shift of the next frame, radius 0 if tracking is not steady
+struct ShiftPrediction {
+    cv::Point2f position;
+    int radius = 0;
+};
+
+//
+// Global shift of a frame against the reference ROI.
+//
+// With levels == 0 the whole ROI is phase correlated at full resolution. Otherwise the
+// shift is estimated on the ROI decimated by 2^levels and refined at full resolution in a
+// small window placed at the predicted position, so large drift is found at the cost of
+// two small transforms. The shift is trusted when both estimates agree within one
+// decimated pixel.
+//
+// Given a prediction, a small patch at the ROI centre is matched directly (normalized cross
+// correlation) at integer shifts within the predicted radius first, transforms are used
+// only if the match is weak or lies on the border of the searched area
+//
+class Registrator {
+public:
+    static constexpr int local_patch = 64;
+    static constexpr int max_local_radius = 6;
+    static constexpr float min_local_score = 0.5f;
+
+    void init(cv::Size frame,cv::Rect roi,int levels)
+    {
+        frame_ = frame;
+        roi_ = roi;
+        levels_ = levels;
+        patch_ = std::min(local_patch,std::min(roi_.width,roi_.height)) / lanes * lanes;
+        patch_pos_ = cv::Point(roi_.x + (roi_.width - patch_) / 2,roi_.y + (roi_.height - patch_) / 2);
+        int area = patch_ + 2 * max_local_radius;
+        template_.resize(patch_ * patch_);
+        area_.resize(area * area);
+        scores_.resize((2 * max_local_radius + 1) * (2 * max_local_radius + 1));
+        if(levels_ == 0) {
+            full_.init(roi_.width);
+            return;
+        }
+        int d = 1 << levels_;
+        int coarse = roi_.width / d;
+        if(coarse < 8)
+            throw std::runtime_error("ROI is too small for pyramid registration");
+        coarse_.init(coarse,d);
+        // fine window is recentred on the prediction so it fully overlaps the reference,
+        // half of the ROI keeps sub pixel accuracy close to the full one
+        int fine = std::min(std::max(roi_.width / 2,32),std::min(roi_.width,roi_.height));
+        fine_.init(fine);
+        fine_pos_ = cv::Point(roi_.x + (roi_.width - fine) / 2,roi_.y + (roi_.height - fine) / 2);
+    }
+    int levels() const
+    {
+        return levels_;
+    }
+    // frame is CV_32FC1 or CV_32FC3 of init size
+    void set_reference(cv::Mat const &frame)
+    {
+        if(patch_ > 0)
+            set_template(frame);
+        if(levels_ == 0) {
+            full_.set_reference(frame,roi_.tl());
+        }
+        else {
+            coarse_.set_reference(frame,roi_.tl());
+            fine_.set_reference(frame,fine_pos_);
+        }
+    }
+    // reference of other registrator with the same settings, each thread needs its own
+    void copy_reference(Registrator const &other)
+    {
+        template_ = other.template_;
+        template_norm_ = other.template_norm_;
+        if(levels_ == 0) {
+            full_.copy_reference(other.full_);
+        }
+        else {
+            coarse_.copy_reference(other.coarse_);
+            fine_.copy_reference(other.fine_);
+        }
+    }
+    // shift to add the frame at, see Stacker::add_image
+    cv::Point2f find_shift(cv::Mat const &frame,ShiftPrediction const &prediction,bool &trusted)
+    {
+        trusted = false;
+        cv::Point2f local;
+        if(prediction.radius > 0 && local_search(frame,prediction,local))
+            return local;
+        if(levels_ == 0)
+            return full_.find_shift(frame,roi_.tl());
+        int d = 1 << levels_;
+        cv::Point2f predicted = coarse_.find_shift(frame,roi_.tl()) * float(d);
+        // frame(x) matches reference(x + shift), so the reference window is found at
+        // fine_pos_ - shift, clamped to the frame
+        int fine = fine_.size();
+        cv::Point pos(fine_pos_.x - cvRound(predicted.x),fine_pos_.y - cvRound(predicted.y));
+        pos.x = std::max(0,std::min(frame_.width - fine,pos.x));
+        pos.y = std::max(0,std::min(frame_.height - fine,pos.y));
+        cv::Point2f residual = fine_.find_shift(frame,pos);
+        cv::Point2f shift(float(fine_pos_.x - pos.x) + residual.x,float(fine_pos_.y - pos.y) + residual.y);
+        trusted = std::abs(shift.x - predicted.x) <= d && std::abs(shift.y - predicted.y) <= d;
+        return shift;
+    }
+private:
+    void read_green(cv::Mat const &frame,cv::Point pos,int size,float *tgt)
+    {
+        int channels = frame.channels();
+        int channel = channels == 1 ? 0 : 1;
+        for(int r=0;r<size;r++) {
+            float const *src = frame.ptr<float>(pos.y + r) + pos.x * channels + channel;
+            for(int c=0;c<size;c++)
+                tgt[r * size + c] = src[c * channels];
+        }
+    }
+    void set_template(cv::Mat const &frame)
+    {
+        read_green(frame,patch_pos_,patch_,template_.data());
+        int n = patch_ * patch_;
+        double sum = 0;
+        for(int i=0;i<n;i++)
+            sum += template_[i];
+        float mean = float(sum / n);
+        template_norm_ = 0;
+        for(int i=0;i<n;i++) {
+            template_[i] -= mean;
+            template_norm_ += double(template_[i]) * template_[i];
+        }
+    }
+    static constexpr int lanes = 8;
+    // sums of f, f*f and f*t, n is a multiple of lanes. Lanes are independent so the compiler
+    // keeps them in vector registers without reassociating float additions
+    static void correlate_row(float const *__restrict f,float const *__restrict t,int n,float *__restrict acc)
+    {
+        for(int c=0;c<n;c+=lanes) {
+            for(int l=0;l<lanes;l++) {
+                float v = f[c + l];
+                acc[l] += v;
+                acc[lanes + l] += v * v;
+                acc[2 * lanes + l] += v * t[c + l];
+            }
+        }
+    }
+    bool local_search(cv::Mat const &frame,ShiftPrediction const &prediction,cv::Point2f &shift)
+    {
+        if(patch_ == 0)
+            return false;
+        int R = std::min(prediction.radius,max_local_radius);
+        cv::Point center(cvRound(prediction.position.x),cvRound(prediction.position.y));
+        // frame(x) matches reference(x + shift), candidate shifts center +/- R cover this area
+        int area = patch_ + 2 * R;
+        cv::Point origin(patch_pos_.x - center.x - R,patch_pos_.y - center.y - R);
+        if(origin.x < 0 || origin.y < 0 || origin.x + area > frame_.width || origin.y + area > frame_.height)
+            return false;
+        read_green(frame,origin,area,area_.data());
+        int side = 2 * R + 1;
+        int n = patch_ * patch_;
+        int best = 0;
+        for(int u=0;u<side;u++) {
+            for(int v=0;v<side;v++) {
+                float acc[3 * lanes] = {};
+                for(int r=0;r<patch_;r++)
+                    correlate_row(area_.data() + (u + r) * area + v,template_.data() + r * patch_,patch_,acc);
+                double sf = 0,sff = 0,sft = 0;
+                for(int l=0;l<lanes;l++) {
+                    sf += acc[l];
+                    sff += acc[lanes + l];
+                    sft += acc[2 * lanes + l];
+                }
+                // template has zero mean so sft is already the covariance
+                double var = sff - sf * sf / n;
+                float score = var > 0 && template_norm_ > 0 ? float(sft / std::sqrt(var * template_norm_)) : 0.0f;
+                scores_[u * side + v] = score;
+                if(score > scores_[best])
+                    best = u * side + v;
+            }
+        }
+        int bu = best / side;
+        int bv = best % side;
+        // peak on the border may continue outside of the searched area
+        if(scores_[best] < min_local_score || bu == 0 || bv == 0 || bu == side - 1 || bv == side - 1)
+            return false;
+        float const *s = scores_.data() + best;
+        float ou = parabolic_offset(s[-side],s[0],s[side]);
+        float ov = parabolic_offset(s[-1],s[0],s[1]);
+        shift = cv::Point2f(center.x + R - bv - ov,center.y + R - bu - ou);
+        return true;
+    }
+
+    cv::Size frame_;
+    cv::Rect roi_;
+    int levels_ = 0;
+    PhaseCorrelator full_;
+    PhaseCorrelator coarse_;
+    PhaseCorrelator fine_;
+    cv::Point fine_pos_;
+    int patch_ = 0;
+    cv::Point patch_pos_;
+    std::vector<float> template_;
+    double template_norm_ = 0;
+    std::vector<float> area_;
+    std::vector<float> scores_;
+};
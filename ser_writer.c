@@ -0,0 +1,248 @@
+#include "ser_writer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define SER_HEADER_SIZE 178
+#define SER_UNIX_EPOCH_TICKS 621355968000000000LL
+// single write longer than that is counted as a storage stall
+#define SER_STALL_NS 50000000LL
+
+int64_t ser_time_from_timespec(struct timespec const *ts)
+{
+    return SER_UNIX_EPOCH_TICKS + (int64_t)ts->tv_sec * 10000000 + ts->tv_nsec / 100;
+}
+
+int64_t ser_time_from_unix_us(int64_t us)
+{
+    return SER_UNIX_EPOCH_TICKS + us * 10;
+}
+
+int64_t ser_time_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME,&ts);
+    return ser_time_from_timespec(&ts);
+}
+
+static int64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned char *put_le(unsigned char *p,uint64_t v,int bytes)
+{
+    int i;
+    for(i=0;i<bytes;i++) {
+        *p++ = v & 0xFF;
+        v >>= 8;
+    }
+    return p;
+}
+
+static int write_all(int fd,void const *data,size_t size)
+{
+    char const *p = (char const *)data;
+    while(size > 0) {
+        ssize_t n = write(fd,p,size);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int write_header(ser_writer *w,int frames,int64_t start_time)
+{
+    unsigned char header[SER_HEADER_SIZE];
+    unsigned char *p = header;
+    memset(header,0,sizeof(header));
+    memcpy(p,"LUCAM-RECORDER",14);
+    p += 14;
+    p = put_le(p,0,4);            // LuID
+    p = put_le(p,w->color_id,4);
+    p = put_le(p,1,4);            // little endian 16 bit data, per SER v3 spec
+    p = put_le(p,w->width,4);
+    p = put_le(p,w->height,4);
+    p = put_le(p,w->bits,4);
+    p = put_le(p,frames,4);
+    p += 40 * 3;                  // observer, instrument, telescope
+    p = put_le(p,start_time,8);   // local time, no time zone info here
+    p = put_le(p,start_time,8);   // UTC
+    if(pwrite(w->fd,header,sizeof(header),0) != (ssize_t)sizeof(header))
+        return -1;
+    return 0;
+}
+
+static void *writer_thread(void *ptr)
+{
+    ser_writer *w = (ser_writer *)ptr;
+    pthread_mutex_lock(&w->lock);
+    for(;;) {
+        while(w->head == w->tail && !w->stop)
+            pthread_cond_wait(&w->cond,&w->lock);
+        if(w->head == w->tail)
+            break;
+        int slot = w->tail % w->queue_size;
+        int64_t timestamp = w->queue_ts[slot];
+        int failed = w->stats.failed;
+        pthread_mutex_unlock(&w->lock);
+
+        int64_t start = monotonic_ns();
+        int ok = !failed && write_all(w->fd,w->memory + w->frame_size * slot,w->frame_size) == 0;
+        int64_t passed = monotonic_ns() - start;
+        if(ok && w->timestamps_N == w->timestamps_capacity) {
+            size_t new_capacity = w->timestamps_capacity * 2;
+            int64_t *tmp = (int64_t *)realloc(w->timestamps,new_capacity * sizeof(int64_t));
+            if(tmp) {
+                w->timestamps = tmp;
+                w->timestamps_capacity = new_capacity;
+            }
+            else {
+                ok = 0;
+            }
+        }
+        if(ok)
+            w->timestamps[w->timestamps_N++] = timestamp;
+
+        pthread_mutex_lock(&w->lock);
+        w->tail++;
+        if(ok)
+            w->stats.frames_written++;
+        else
+            w->stats.failed = 1;
+        if(passed > SER_STALL_NS)
+            w->stats.write_stalls++;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+int ser_writer_open(ser_writer *w,char const *path,int width,int height,int bytes_per_pixel,int queue_size)
+{
+    memset(w,0,sizeof(*w));
+    w->fd = -1;
+    if(width <= 0 || height <= 0 || bytes_per_pixel < 1 || bytes_per_pixel > 3 || queue_size <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    w->width = width;
+    w->height = height;
+    w->color_id = bytes_per_pixel == 3 ? SER_COLOR_RGB : SER_COLOR_MONO;
+    w->bits = bytes_per_pixel == 2 ? 16 : 8;
+    w->frame_size = (size_t)width * height * bytes_per_pixel;
+    w->queue_size = queue_size;
+    w->stats.queue_size = queue_size;
+    w->memory = (char *)malloc(w->frame_size * queue_size);
+    w->queue_ts = (int64_t *)malloc(sizeof(int64_t) * queue_size);
+    w->timestamps_capacity = 1024;
+    w->timestamps = (int64_t *)malloc(sizeof(int64_t) * w->timestamps_capacity);
+    if(!w->memory || !w->queue_ts || !w->timestamps) {
+        ser_writer_close(w);
+        errno = ENOMEM;
+        return -1;
+    }
+    w->fd = open(path,O_WRONLY | O_CREAT | O_TRUNC,0644);
+    if(w->fd < 0 || write_header(w,0,ser_time_now()) < 0) {
+        int err = errno;
+        ser_writer_close(w);
+        errno = err;
+        return -1;
+    }
+    lseek(w->fd,SER_HEADER_SIZE,SEEK_SET);
+    pthread_mutex_init(&w->lock,NULL);
+    pthread_cond_init(&w->cond,NULL);
+    if(pthread_create(&w->thread,NULL,writer_thread,w) != 0) {
+        pthread_cond_destroy(&w->cond);
+        pthread_mutex_destroy(&w->lock);
+        ser_writer_close(w);
+        errno = EAGAIN;
+        return -1;
+    }
+    w->running = 1;
+    return 0;
+}
+
+int ser_writer_push(ser_writer *w,void const *data,int64_t timestamp)
+{
+    pthread_mutex_lock(&w->lock);
+    if(w->stats.failed || w->head - w->tail >= (unsigned)w->queue_size) {
+        w->stats.frames_dropped++;
+        pthread_mutex_unlock(&w->lock);
+        return -1;
+    }
+    int slot = w->head % w->queue_size;
+    pthread_mutex_unlock(&w->lock);
+
+    // slot is owned by producer until head is advanced
+    memcpy(w->memory + w->frame_size * slot,data,w->frame_size);
+    w->queue_ts[slot] = timestamp;
+
+    pthread_mutex_lock(&w->lock);
+    w->head++;
+    if((int)(w->head - w->tail) > w->stats.queue_high_water)
+        w->stats.queue_high_water = w->head - w->tail;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+void ser_writer_get_stats(ser_writer *w,ser_writer_stats *stats)
+{
+    pthread_mutex_lock(&w->lock);
+    *stats = w->stats;
+    pthread_mutex_unlock(&w->lock);
+}
+
+int ser_writer_close(ser_writer *w)
+{
+    int res = 0;
+    if(w->running) {
+        pthread_mutex_lock(&w->lock);
+        w->stop = 1;
+        pthread_cond_signal(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->thread,NULL);
+        pthread_cond_destroy(&w->cond);
+        pthread_mutex_destroy(&w->lock);
+        w->running = 0;
+
+        size_t i;
+        int64_t start_time = w->timestamps_N > 0 ? w->timestamps[0] : ser_time_now();
+        // trailer is converted in place to little endian and written at once
+        for(i=0;i<w->timestamps_N;i++)
+            put_le((unsigned char *)(w->timestamps + i),w->timestamps[i],8);
+        // failed or partial frame writes leave data past the counted frames, the trailer
+        // must follow the last complete one
+        off_t end = SER_HEADER_SIZE + (off_t)w->frame_size * w->stats.frames_written;
+        if(ftruncate(w->fd,end) < 0 || lseek(w->fd,end,SEEK_SET) < 0)
+            res = -1;
+        if(res == 0)
+            res = write_all(w->fd,w->timestamps,w->timestamps_N * 8);
+        if(res == 0)
+            res = write_header(w,w->stats.frames_written,start_time);
+        if(w->stats.failed)
+            res = -1;
+    }
+    if(w->fd >= 0) {
+        if(close(w->fd) < 0)
+            res = -1;
+        w->fd = -1;
+    }
+    free(w->memory);
+    free(w->queue_ts);
+    free(w->timestamps);
+    w->memory = NULL;
+    w->queue_ts = NULL;
+    w->timestamps = NULL;
+    return res;
+}
@@ -0,0 +1,59 @@
+#ifndef SER_WRITER_H
+#define SER_WRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define SER_COLOR_MONO 0
+#define SER_COLOR_RGB 100
+
+typedef struct ser_writer_stats {
+    int frames_written;
+    int frames_dropped;
+    int queue_size;
+    int queue_high_water;
+    int write_stalls;
+    int failed;
+} ser_writer_stats;
+
+//
+// SER file recorder. Frames are copied into a bounded ring by the producer and
+// written by a separate I/O thread, so slow storage drops frames from the
+// recording instead of stalling the capture
+//
+typedef struct ser_writer {
+    int fd;
+    int width;
+    int height;
+    int color_id;
+    int bits;
+    size_t frame_size;
+    int queue_size;
+    char *memory;
+    int64_t *queue_ts;
+    unsigned head,tail;
+    int stop;
+    int running;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int64_t *timestamps;
+    size_t timestamps_N,timestamps_capacity;
+    ser_writer_stats stats;
+} ser_writer;
+
+// bytes_per_pixel 1,2 - mono 8/16 bit, 3 - RGB24. Returns -1 and sets errno on failure
+int ser_writer_open(ser_writer *w,char const *path,int width,int height,int bytes_per_pixel,int queue_size);
+// never blocks on I/O, returns -1 if the frame was dropped
+int ser_writer_push(ser_writer *w,void const *data,int64_t timestamp);
+void ser_writer_get_stats(ser_writer *w,ser_writer_stats *stats);
+// writes queued frames, timestamps trailer and final frame count
+int ser_writer_close(ser_writer *w);
+
+// current UTC time in SER units - 100ns ticks since 0001-01-01
+int64_t ser_time_now(void);
+int64_t ser_time_from_timespec(struct timespec const *ts);
+int64_t ser_time_from_unix_us(int64_t us);
+
+#endif
@@ -8,17 +8,30 @@
 #define LOG(format, ...) fprintf(stderr,"[%s:%d/%s] " format "\n", basename(__FILE__), __LINE__, __FUNCTION__, ##__VA_ARGS__)
 #endif
 #include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
 
 #include "rotation.h"
+#include "registration.h"
+#include "tile_alignment.h"
+#include "median_stack.h"
+#include "calibration.h"
+#include "master_frame.h"
+#include "yuv2rgb.h"
 
 #ifdef INCLUDE_MAIN
 #ifdef DO_STACK
 #include <opencv2/imgcodecs.hpp>
+// empty if the file can't be read or decoded
 static cv::Mat imreadrgb(std::string const &path)
 {
     cv::Mat tmp=cv::imread(path);
     cv::Mat img;
-    cv::cvtColor(tmp,img,cv::COLOR_BGR2RGB);
+    if(!tmp.empty())
+        cv::cvtColor(tmp,img,cv::COLOR_BGR2RGB);
     return img;
 }
 
@@ -37,12 +50,14 @@ static void imwritergb(std::string const &path,cv::Mat m)
 struct Stacker {
 public:
 
-    Stacker(int width,int height,int roi_x=-1,int roi_y=-1,int roi_size = -1,int exp_multiplier=1) : 
+    Stacker(int width,int height,int roi_x=-1,int roi_y=-1,int roi_size = -1,int exp_multiplier=1,int channels=3) : 
         frames_(0),
-        has_darks_(false),
-        exp_multiplier_(exp_multiplier)
+        exp_multiplier_(exp_multiplier),
+        channels_(channels)
     {
         error_message_[0]=0;
+        if(channels_ != 1 && channels_ != 3)
+            throw std::runtime_error("Only mono or RGB images are supported");
         fully_stacked_area_ = cv::Rect(0,0,width,height);
         if(roi_size == -1) {
             window_size_ = std::min(height,width);
@@ -69,15 +84,79 @@ public:
             dy_ = std::min(height-window_size_,dy_);
         }
         
-        sum_ = cv::Mat(height,width,CV_32FC3);
-        count_ = cv::Mat(height,width,CV_32FC3);
-        make_fft_blur();
+        sum_ = cv::Mat::zeros(height,width,CV_MAKETYPE(CV_32F,channels_));
+        count_ = cv::Mat::zeros(height,width,CV_MAKETYPE(CV_32F,channels_));
+        if(window_size_ > 0)
+            registrator_.init(sum_.size(),cv::Rect(dx_,dy_,window_size_,window_size_),0);
+        prepare_scratch(sync_);
+    }
+    ~Stacker()
+    {
+        stop_pipeline();
+    }
+
+    // reallocations of the stacker's own per frame buffers (see scratch()), heap use of
+    // OpenCV and the standard library is not seen here, test_allocations() checks all of it
+    int allocations() const
+    {
+        return allocations_;
+    }
+
+    // 0 registers the whole ROI, 1 or 2 estimate on ROI decimated by 2 or 4 and refine
+    // at full resolution, see Registrator. Changes the reference so only before stacking
+    void set_pyramid(int levels)
+    {
+        if(levels < 0 || levels > 2)
+            throw std::runtime_error("Pyramid levels must be 0 to 2");
+        if(frames_ > 0 || !threads_.empty())
+            throw std::runtime_error("Pyramid must be set before stacking");
+        if(window_size_ > 0)
+            registrator_.init(sum_.size(),cv::Rect(dx_,dy_,window_size_,window_size_),levels);
+    }
+    // multi point alignment with tiles of given size overlapping by half, 0 - global shift only.
+    // Tiles are aligned on top of the global registration so only before stacking
+    void set_tiles(int tile)
+    {
+        if(frames_ > 0 || !threads_.empty())
+            throw std::runtime_error("Tiles must be set before stacking");
+        if(tile != 0 && (tile < 16 || tile > std::min(sum_.rows,sum_.cols)))
+            throw std::runtime_error("Invalid tile size");
+        if(tile != 0 && window_size_ == 0)
+            throw std::runtime_error("Tile alignment requires registration");
+        tile_size_ = tile;
+        if(tile_size_ == 0)
+            return;
+        tiles_.init(sum_.size(),tile_size_);
+        // one correlator and row buffer per parallel stripe
+        int stripes = std::max(1,cv::getNumThreads());
+        tile_correlators_.clear();
+        tile_correlators_.resize(stripes);
+        for(auto &c : tile_correlators_)
+            c.init(tile_size_,1,TileAligner::low_pass);
+        tile_rows_.assign(stripes,std::vector<cv::Point2f>(sum_.cols));
+        offsets_.resize(tiles_.tiles());
+    }
+
+    // kappa-sigma rejection while stacking, samples further than kappa standard deviations
+    // from the running mean of the pixel are not added, 0 - off. Only before stacking since
+    // the variance is tracked from the first frame
+    void set_rejection(float kappa)
+    {
+        if(frames_ > 0 || !threads_.empty())
+            throw std::runtime_error("Rejection must be set before stacking");
+        if(kappa < 0)
+            throw std::runtime_error("Invalid rejection kappa");
+        kappa_ = kappa;
+        if(kappa_ > 0)
+            m2_ = cv::Mat::zeros(sum_.rows,sum_.cols,sum_.type());
+        else
+            m2_.release();
     }
 
     void set_source_gamma(float g)
     {
+        wait_pipeline();
         src_gamma_ = g;
-        darks_corrected_ = false;
     }
     void set_target_gamma(float g)
     {
@@ -91,68 +170,122 @@ public:
         }
     }
 
-    void make_fft_blur()
+    // single dark of unknown exposure, subtracted as is
+    void set_darks(unsigned char *rgb_img)
     {
-        if(window_size_ == 0)
-            return;
-        fft_kern_ = cv::Mat(window_size_,window_size_,CV_32FC2);
-        int rad = (window_size_/16);
-        for(int r=0;r<window_size_;r++) {
-            for(int c=0;c<window_size_;c++) {
-                int dy = fft_pos(r);
-                int dx = fft_pos(c);
-                std::complex<float> val = 1;
-                if(dx*dx+dy*dy > rad*rad) {
-                    val = 0;
-                }
-                fft_kern_.at<std::complex<float> >(r,c) = val;
-            }
+        wait_pipeline();
+        calibration_.clear(Calibration::DARK);
+        add_master(STACKER_MASTER_DARK,STACKER_FORMAT_RGB,rgb_img,-1,-1);
+    }
+    // kind STACKER_MASTER_*, format STACKER_FORMAT_RGB, MONO16 or FLOAT, negative exposure
+    // or gain is unknown
+    void add_master(int kind,int format,void const *data,float exposure_ms,float gain)
+    {
+        wait_pipeline();
+        cv::Mat master;
+        switch(format) {
+        case STACKER_FORMAT_RGB:
+            cv::Mat(sum_.rows,sum_.cols,CV_MAKETYPE(CV_8U,channels_),const_cast<void *>(data)).convertTo(master,CV_32F,1/255.0);
+            break;
+        case STACKER_FORMAT_MONO16:
+            cv::Mat(sum_.rows,sum_.cols,CV_MAKETYPE(CV_16U,channels_),const_cast<void *>(data)).convertTo(master,CV_32F,1/65535.0);
+            break;
+        case STACKER_FORMAT_FLOAT:
+            master = cv::Mat(sum_.rows,sum_.cols,CV_MAKETYPE(CV_32F,channels_),const_cast<void *>(data)).clone();
+            break;
+        default:
+            throw std::runtime_error("Invalid master format");
         }
+        calibration_.add(kind,master,exposure_ms,gain);
     }
-
-    void set_darks(unsigned char *rgb_img)
+    // image as returned by load_master, already in source domain, is kept as is
+    void add_master(MasterHeader const &h,cv::Mat image)
     {
-        has_darks_ = true;
-        darks_corrected_ = false;
-        cv::Mat src(sum_.rows,sum_.cols,CV_8UC3,rgb_img);
-        src.convertTo(darks_,CV_32FC3,1/(255.0));
+        if(image.rows != sum_.rows || image.cols != sum_.cols || image.channels() != channels_)
+            throw std::runtime_error("Master does not match frame size");
+        calibration_.add(h.kind,image,h.exposure_ms,h.gain);
+    }
+    void clear_masters()
+    {
+        wait_pipeline();
+        for(int kind : {Calibration::BIAS,Calibration::DARK,Calibration::FLAT})
+            calibration_.clear(kind);
+    }
+    // exposure and gain of following frames, masters are picked by them
+    void set_frame_settings(float exposure_ms,float gain)
+    {
+        wait_pipeline();
+        calibration_.set_frame(exposure_ms,gain);
     }
 
     void save_stacked_darks(char const *path)
     {
+        save_master(path,STACKER_MASTER_DARK,STACKER_SAMPLE_HALF,NAN);
+    }
+    // stacked image as master of kind STACKER_MASTER_*, exposure and gain are the frame settings
+    void save_master(char const *path,int kind,int sample_type,float temperature)
+    {
+        if(kind < STACKER_MASTER_BIAS || kind > STACKER_MASTER_FLAT)
+            throw std::runtime_error("Invalid master kind");
+        std::lock_guard<std::mutex> guard(sum_lock_);
         cv::Mat stacked  = sum_ / count_;
-        std::ofstream f(path);
-        if(!f)
-            throw std::runtime_error("Failed to open darks path");
-        if(!f.write((char *)stacked.data,stacked.rows*stacked.cols*sizeof(float)*3))
-            throw std::runtime_error("Failed to save darks");
+        MasterHeader h = MasterHeader();
+        h.sample_type = sample_type;
+        h.kind = kind;
+        h.frames = frames_;
+        h.exposure_ms = calibration_.frame_exposure_ms();
+        h.gain = calibration_.frame_gain();
+        h.temperature = temperature;
+        h.gamma = src_gamma_;
+        ::save_master(path,stacked,h);
+    }
+    // master of kind given by the file
+    void load_master(char const *path)
+    {
+        wait_pipeline();
+        MasterHeader h;
+        cv::Mat image;
+        if(!::load_master(path,h,image))
+            throw std::runtime_error("Not a master file");
+        add_master(h,image);
     }
     void get_stacked_darks(char *buffer)
     {
+        std::lock_guard<std::mutex> guard(sum_lock_);
         cv::Mat stacked  = sum_ / count_;
-        cv::Mat res(sum_.cols,sum_.rows,CV_8UC3,buffer);
-        stacked.convertTo(res,CV_8UC3,255);
+        cv::Mat res(sum_.rows,sum_.cols,CV_MAKETYPE(CV_8U,channels_),buffer);
+        stacked.convertTo(res,CV_8U,255);
     }
 
+    // master file or raw float frame as written by older versions
     void load_darks(char const *path)
     {
-        has_darks_ = true;
-        darks_corrected_ = false;
-        darks_ = cv::Mat(sum_.rows,sum_.cols,CV_32FC3); 
+        wait_pipeline();
+        MasterHeader h;
+        cv::Mat image;
+        if(::load_master(path,h,image)) {
+            calibration_.clear(Calibration::DARK);
+            h.kind = Calibration::DARK;
+            add_master(h,image);
+            return;
+        }
+        cv::Mat darks(sum_.rows,sum_.cols,sum_.type());
         std::ifstream f(path);
         if(!f)
             throw std::runtime_error("Failed to open darks file");
-        f.read((char *)darks_.data,sum_.rows*sum_.cols*sizeof(float)*3);
+        f.read((char *)darks.data,sum_.rows*sum_.cols*sizeof(float)*channels_);
         if(!f)
             throw std::runtime_error("Failed to read darks file");
+        calibration_.clear(Calibration::DARK);
+        calibration_.add(Calibration::DARK,darks,-1,-1);
     }
     
     cv::Mat get_stacked_image()
     {
-        //cv::Mat tmp = sum_ / count_;
-        cv::Mat tmp = sum_ * (1.0/ fully_stacked_count_);
+        // rejected samples are left out of sum_ and count_, a common divisor would darken them
+        cv::Mat tmp = kappa_ > 0 ? cv::Mat(sum_ / count_) : cv::Mat(sum_ * (1.0/ fully_stacked_count_));
         if(enable_stretch_) {
-            double scale[3],offset[3],mean=0.5;
+            double scale[3]={1,1,1},offset[3]={0,0,0},mean=0.5;
             calc_scale_offset2(tmp(fully_stacked_area_),scale,offset);
             tmp = tmp.mul(cv::Scalar(scale[0],scale[1],scale[2]));
             tmp += cv::Scalar(offset[0],offset[1],offset[2]);
@@ -179,10 +312,11 @@ public:
     }
     void get_stacked(unsigned char *rgb_img)
     {
+        std::lock_guard<std::mutex> guard(sum_lock_);
         if(frames_ == 0)
-            memset(rgb_img,0,sum_.rows*sum_.cols*3);
+            memset(rgb_img,0,sum_.rows*sum_.cols*channels_);
         else {
-            cv::Mat tgt(sum_.rows,sum_.cols,CV_8UC3,rgb_img);
+            cv::Mat tgt(sum_.rows,sum_.cols,CV_MAKETYPE(CV_8U,channels_),rgb_img);
             cv::Mat tmp = get_stacked_image();
             //tmp.convertTo(tgt,CV_8UC3,scale,offset);
             tmp.convertTo(tgt,CV_8UC3,255,0);
@@ -191,92 +325,635 @@ public:
     
     void save_stacked(char const *path)
     {
+        std::lock_guard<std::mutex> guard(sum_lock_);
         cv::Mat img = get_stacked_image();
         cv::imwrite(path,img);
     }
     
     bool stack_image(unsigned char *rgb_img,bool restart_position = false,float rotate=0)
     {
-        cv::Mat frame8bit(sum_.rows,sum_.cols,CV_8UC3,rgb_img);
-        cv::Mat frame;
-        frame8bit.convertTo(frame,CV_32FC3,1.0/255);
-        return stack_image((float*)(frame.data),restart_position,rotate);
+        wait_pipeline();
+        if(exp_multiplier_ != 1)
+            return stack_float(to_float(sync_,rgb_img),restart_position,rotate);
+        update_calibration();
+        return stack_calibrated(calibrate(sync_,STACKER_FORMAT_RGB,rgb_img),restart_position,rotate);
+    }
+    bool stack_image(unsigned short *img,bool restart_position = false,float rotate=0)
+    {
+        wait_pipeline();
+        if(exp_multiplier_ != 1)
+            return stack_float(to_float(sync_,img),restart_position,rotate);
+        update_calibration();
+        return stack_calibrated(calibrate(sync_,STACKER_FORMAT_MONO16,img),restart_position,rotate);
+    }
+    bool stack_yuyv(unsigned char const *yuyv,bool restart_position = false,float rotate=0)
+    {
+        wait_pipeline();
+        if(exp_multiplier_ != 1) {
+            // gamma is applied to averaged exposure, can't be fused
+            cv::Mat &img = scratch(sync_.input8,sum_.rows,sum_.cols,CV_MAKETYPE(CV_8U,channels_));
+            if(channels_ == 1) {
+                for(int i=0;i<sum_.rows*sum_.cols;i++)
+                    img.data[i] = yuyv[2*i];
+            }
+            else {
+                yuyv2rgb(yuyv,img.data,sum_.rows*sum_.cols);
+            }
+            return stack_float(to_float(sync_,img.data),restart_position,rotate);
+        }
+        update_calibration();
+        return stack_calibrated(calibrate_yuyv(sync_,yuyv),restart_position,rotate);
     }
     bool stack_image(float *rgb_img,bool restart_position = false,float rotate=0)
     {
-        cv::Mat frame_in(sum_.rows,sum_.cols,CV_32FC3,rgb_img);
-        cv::Mat frame = frame_in.clone();
+        wait_pipeline();
+        cv::Mat frame_in(sum_.rows,sum_.cols,CV_MAKETYPE(CV_32F,channels_),rgb_img);
+        return stack_float(frame_in,restart_position,rotate);
+    }
+
+    // Asynchronous stacking: calibration and registration run on worker threads,
+    // frames are accumulated on a separate thread strictly in submission order.
+    // At most queue_depth submitted frames are kept, submit blocks when all are in use
+    void start_pipeline(int threads,int queue_depth,stacker_callback_type callback,void *user_data)
+    {
+        stop_pipeline();
+        if(exp_multiplier_ != 1)
+            throw std::runtime_error("Exposure multiplier is not supported by pipeline");
+        if(threads <= 0)
+            threads = std::max(1,int(std::thread::hardware_concurrency()) - 1);
+        if(queue_depth <= 0)
+            queue_depth = threads * 2;
+        // one frame is accumulated while the others are registered
+        queue_depth = std::max(queue_depth,threads + 1);
+        callback_ = callback;
+        callback_data_ = user_data;
+        jobs_.clear();
+        jobs_.resize(queue_depth);
+        size_t pixels = size_t(sum_.rows) * sum_.cols;
+        size_t max_bytes = std::max(pixels * channels_ * sizeof(unsigned short),pixels * 2);
+        for(auto &job : jobs_) {
+            job.data.resize(max_bytes);
+            prepare_scratch(job.scratch);
+        }
+        registrators_.clear();
+        registrators_.resize(threads);
+        for(auto &r : registrators_) {
+            if(window_size_ > 0) {
+                r.init(sum_.size(),cv::Rect(dx_,dy_,window_size_,window_size_),registrator_.levels());
+                if(frames_ > 0)
+                    r.copy_reference(registrator_);
+            }
+        }
+        // tiles of a frame are aligned by its worker, the pipeline is parallel over frames
+        worker_tile_correlators_.clear();
+        worker_tile_correlators_.resize(threads);
+        if(tile_size_ > 0) {
+            for(auto &c : worker_tile_correlators_)
+                c.init(tile_size_,1,TileAligner::low_pass);
+            for(auto &job : jobs_)
+                job.offsets.resize(tiles_.tiles());
+        }
+        submitted_ = next_take_ = next_done_ = 0;
+        has_reference_ = frames_ > 0;
+        stop_ = false;
+        for(int i=0;i<threads;i++)
+            threads_.emplace_back(&Stacker::worker_thread,this,i);
+        threads_.emplace_back(&Stacker::accumulator_thread,this);
+    }
+    // copies the frame, returns its id as passed to callback
+    int submit(int format,void const *data,bool restart_position)
+    {
+        if(threads_.empty())
+            throw std::runtime_error("Pipeline is not started");
+        if(format < STACKER_FORMAT_RGB || format > STACKER_FORMAT_YUYV)
+            throw std::runtime_error("Invalid frame format");
+        {
+            // producers may submit concurrently, the first one stacks the reference
+            std::lock_guard<std::mutex> reference_guard(submit_lock_);
+            // workers only read calibration data, settings change after the pipeline is drained
+            update_calibration();
+            if(!has_reference_)
+                return submit_reference(format,data,restart_position);
+        }
+        // id and slot are reserved under the lock, the slot is reused once the frame
+        // that held it jobs_.size() ids earlier is accumulated
+        std::unique_lock<std::mutex> guard(pipeline_lock_);
+        int id = submitted_++;
+        Job &job = jobs_[id % jobs_.size()];
+        pipeline_cond_.wait(guard,[&]{ return id < next_done_ + int(jobs_.size()); });
+        job.id = id;
+        job.state = JOB_FILLING;
+        guard.unlock();
+        // no other thread touches the job while it is filled
+        memcpy(job.data.data(),data,frame_bytes(format));
+        job.format = format;
+        job.restart = restart_position;
+        guard.lock();
+        job.state = JOB_QUEUED;
+        pipeline_cond_.notify_all();
+        return id;
+    }
+    void wait_pipeline()
+    {
+        std::unique_lock<std::mutex> guard(pipeline_lock_);
+        pipeline_cond_.wait(guard,[&]{ return next_done_ == submitted_; });
+    }
+    // frames submitted and not completed yet
+    int pending()
+    {
+        std::unique_lock<std::mutex> guard(pipeline_lock_);
+        return submitted_ - next_done_;
+    }
+    void stop_pipeline()
+    {
+        if(threads_.empty())
+            return;
+        wait_pipeline();
+        {
+            std::unique_lock<std::mutex> guard(pipeline_lock_);
+            stop_ = true;
+            pipeline_cond_.notify_all();
+        }
+        for(auto &t : threads_)
+            t.join();
+        threads_.clear();
+    }
+
+    // Lucky imaging. Two passes: score() every frame and stack the best ones. Single pass:
+    // select() keeps the keep sharpest frames seen so far, flush_selection() stacks them in
+    // capture order, through the pipeline when it is running
+    void set_selection(int keep)
+    {
+        if(keep < 0)
+            throw std::runtime_error("Invalid selection size");
+        if(keep > 0 && exp_multiplier_ != 1)
+            throw std::runtime_error("Exposure multiplier is not supported by frame selection");
+        selected_.clear();
+        selected_.resize(keep);
+        size_t max_bytes = std::max(frame_bytes(STACKER_FORMAT_MONO16),frame_bytes(STACKER_FORMAT_YUYV));
+        for(auto &f : selected_)
+            f.data.resize(max_bytes);
+        selected_count_ = 0;
+    }
+    float score(int format,void const *data)
+    {
+        if(format < STACKER_FORMAT_RGB || format > STACKER_FORMAT_YUYV)
+            throw std::runtime_error("Invalid frame format");
+        update_calibration();
+        return sharpness(calibrate(sync_,format,data));
+    }
+    // true if the frame is kept, it may be replaced by a sharper one later
+    bool select(int format,void const *data,bool restart_position)
+    {
+        if(selected_.empty())
+            throw std::runtime_error("Frame selection is not enabled");
+        float value = score(format,data);
+        if(restart_position)
+            restart_epoch_++;
+        int slot = selected_count_;
+        if(selected_count_ == int(selected_.size())) {
+            slot = 0;
+            for(int i=1;i<selected_count_;i++) {
+                if(selected_[i].score < selected_[slot].score)
+                    slot = i;
+            }
+            if(value <= selected_[slot].score)
+                return false;
+        }
+        else {
+            selected_count_++;
+        }
+        Selected &f = selected_[slot];
+        memcpy(f.data.data(),data,frame_bytes(format));
+        f.score = value;
+        f.sequence = select_sequence_++;
+        f.format = format;
+        f.epoch = restart_epoch_;
+        return true;
+    }
+    // returns number of frames added or submitted
+    int flush_selection()
+    {
+        std::sort(selected_.begin(),selected_.begin() + selected_count_,[](Selected const &a,Selected const &b) {
+            return a.sequence < b.sequence;
+        });
+        int count = 0;
+        if(threads_.empty())
+            update_calibration();
+        for(int i=0;i<selected_count_;i++) {
+            Selected &f = selected_[i];
+            // restart requested by any frame since the previous stacked one, dropped or not
+            bool restart = f.epoch != stacked_epoch_;
+            stacked_epoch_ = f.epoch;
+            if(!threads_.empty()) {
+                submit(f.format,f.data.data(),restart);
+                count++;
+            }
+            else {
+                if(stack_calibrated(calibrate(sync_,f.format,f.data.data()),restart,0))
+                    count++;
+            }
+        }
+        // pipeline copies submitted frames, buffers can be reused right away
+        selected_count_ = 0;
+        return count;
+    }
+private:
+    enum { JOB_FREE, JOB_FILLING, JOB_QUEUED, JOB_REGISTERED };
+    // per frame buffers of calibration, one set for synchronous calls and one per pipeline job
+    struct Scratch {
+        cv::Mat input;      // 8/16 bit input converted to float for exposure averaging
+        cv::Mat input8;     // YUYV decoded for exposure multiplier
+        cv::Mat frame;      // calibrated frame
+        cv::Mat rotated;
+        std::vector<unsigned char> row;
+    };
+    struct Job {
+        int id = 0;
+        int state = JOB_FREE;
+        int format = STACKER_FORMAT_RGB;
+        bool restart = false;
+        std::vector<unsigned char> data;
+        Scratch scratch;
+        cv::Mat frame;
+        cv::Point2f shift;
+        bool trusted = false;
+        std::vector<cv::Point2f> offsets;
+        std::string error;
+    };
+
+    struct Selected {
+        float score = 0;
+        int sequence = 0;
+        int format = STACKER_FORMAT_RGB;
+        int epoch = 0;
+        std::vector<unsigned char> data;
+    };
+
+    static constexpr int score_lanes = 8;
+    // sum of values and squared Laplacian over n floats of interleaved rows, neighbours are
+    // ch apart. Independent lanes are kept in vector registers by the compiler
+    static void laplacian_row(float const *__restrict c,float const *__restrict up,float const *__restrict down,
+                              int ch,int n,float *__restrict acc)
+    {
+        int i = 0;
+        for(;i + score_lanes <= n;i+=score_lanes) {
+            for(int l=0;l<score_lanes;l++) {
+                float v = c[i + l];
+                float lap = 4 * v - c[i + l - ch] - c[i + l + ch] - up[i + l] - down[i + l];
+                acc[l] += v;
+                acc[score_lanes + l] += lap * lap;
+            }
+        }
+        for(;i<n;i++) {
+            float lap = 4 * c[i] - c[i - ch] - c[i + ch] - up[i] - down[i];
+            acc[0] += c[i];
+            acc[score_lanes] += lap * lap;
+        }
+    }
+    // mean squared Laplacian over the registration ROI (whole frame without registration)
+    // relative to squared mean brightness, so transparency changes do not affect ranking
+    float sharpness(cv::Mat const &frame)
+    {
+        cv::Rect roi(0,0,frame.cols,frame.rows);
+        if(window_size_ > 0)
+            roi = cv::Rect(dx_,dy_,window_size_,window_size_);
+        if(roi.width < 3 || roi.height < 3)
+            return 0;
+        int ch = frame.channels();
+        int n = (roi.width - 2) * ch;
+        float acc[2 * score_lanes] = {};
+        double sum = 0,energy = 0;
+        for(int r=roi.y + 1;r<roi.y + roi.height - 1;r++) {
+            int offset = (roi.x + 1) * ch;
+            laplacian_row(frame.ptr<float>(r) + offset,frame.ptr<float>(r - 1) + offset,frame.ptr<float>(r + 1) + offset,ch,n,acc);
+            // flushed per row to keep float lanes accurate over large ROI
+            for(int l=0;l<score_lanes;l++) {
+                sum += acc[l];
+                energy += acc[score_lanes + l];
+                acc[l] = acc[score_lanes + l] = 0;
+            }
+        }
+        double count = double(n) * (roi.height - 2);
+        double mean = sum / count;
+        if(mean <= 0)
+            return 0;
+        return float(energy / count / (mean * mean));
+    }
+
+    // all per frame temporaries live in preallocated buffers, reallocation is counted
+    cv::Mat &scratch(cv::Mat &m,int rows,int cols,int type)
+    {
+        if(m.rows != rows || m.cols != cols || m.type() != type) {
+            m.create(rows,cols,type);
+            allocations_++;
+        }
+        return m;
+    }
+    // float and 8 bit inputs are only needed for exposure averaging of synchronous calls,
+    // calibration writes frame directly
+    void prepare_scratch(Scratch &s)
+    {
+        scratch(s.frame,sum_.rows,sum_.cols,CV_MAKETYPE(CV_32F,channels_));
+        s.row.resize(sum_.cols*3);
+        if(&s == &sync_ && exp_multiplier_ != 1) {
+            scratch(s.input,sum_.rows,sum_.cols,CV_MAKETYPE(CV_32F,channels_));
+            scratch(manual_frame_,sum_.rows,sum_.cols,CV_MAKETYPE(CV_32F,channels_));
+            scratch(s.input8,sum_.rows,sum_.cols,CV_MAKETYPE(CV_8U,channels_));
+        }
+    }
+    size_t frame_bytes(int format) const
+    {
+        size_t pixels = size_t(sum_.rows) * sum_.cols;
+        switch(format) {
+        case STACKER_FORMAT_MONO16: return pixels * channels_ * sizeof(unsigned short);
+        case STACKER_FORMAT_YUYV: return pixels * 2;
+        default: return pixels * channels_;
+        }
+    }
+    cv::Mat to_float(Scratch &s,unsigned char const *img)
+    {
+        cv::Mat frame8bit(sum_.rows,sum_.cols,CV_MAKETYPE(CV_8U,channels_),const_cast<unsigned char *>(img));
+        cv::Mat &frame = scratch(s.input,sum_.rows,sum_.cols,CV_MAKETYPE(CV_32F,channels_));
+        frame8bit.convertTo(frame,CV_32F,1.0/255);
+        return frame;
+    }
+    cv::Mat to_float(Scratch &s,unsigned short const *img)
+    {
+        cv::Mat frame16bit(sum_.rows,sum_.cols,CV_MAKETYPE(CV_16U,channels_),const_cast<unsigned short *>(img));
+        cv::Mat &frame = scratch(s.input,sum_.rows,sum_.cols,CV_MAKETYPE(CV_32F,channels_));
+        frame16bit.convertTo(frame,CV_32F,1.0/65535);
+        return frame;
+    }
+    // conversion to float, source gamma and calibration in a single pass over the frame,
+    // linear maps samples of one row of n values to linear [0,1]
+    template<typename T,typename Linear>
+    cv::Mat calibrate_samples(Scratch &s,T const *img,Linear linear)
+    {
+        cv::Mat &frame = scratch(s.frame,sum_.rows,sum_.cols,CV_MAKETYPE(CV_32F,channels_));
+        int n = sum_.cols * channels_;
+        for(int r=0;r<sum_.rows;r++)
+            calibration_.apply_row(r,img + size_t(r) * n,linear,frame.ptr<float>(r),n);
+        return frame;
+    }
+    // source gamma and calibration, frame_in is continuous and not modified
+    cv::Mat calibrate_float(Scratch &s,cv::Mat frame_in)
+    {
+        float g = src_gamma_;
+        // cv::pow takes absolute values for non integer powers
+        if(g != 1.0f)
+            return calibrate_samples(s,frame_in.ptr<float>(),[g](float v) { return std::pow(std::abs(v),g); });
+        return calibrate_samples(s,frame_in.ptr<float>(),[](float v) { return v; });
+    }
+    cv::Mat calibrate_8bit(Scratch &s,unsigned char const *img)
+    {
+        float const *lut = gamma_lut_;
+        return calibrate_samples(s,img,[lut](unsigned char v) { return lut[v]; });
+    }
+    cv::Mat calibrate_16bit(Scratch &s,unsigned short const *img)
+    {
+        if(src_gamma_ == 1.0f)
+            return calibrate_samples(s,img,[](unsigned short v) { return v * (1.0f / 65535); });
+        float const *lut = gamma_lut16_.data();
+        return calibrate_samples(s,img,[lut](unsigned short v) { return lut[v]; });
+    }
+    // decode, normalization, source gamma and calibration in a single pass over the frame,
+    // mono stacker takes Y plane
+    cv::Mat calibrate_yuyv(Scratch &s,unsigned char const *yuyv)
+    {
+        int rows = sum_.rows;
+        int cols = sum_.cols;
+        cv::Mat &frame = scratch(s.frame,rows,cols,CV_MAKETYPE(CV_32F,channels_));
+        unsigned char *row = s.row.data();
+        float const *lut = gamma_lut_;
+        auto linear = [lut](unsigned char v) { return lut[v]; };
+        for(int r=0;r<rows;r++) {
+            unsigned char const *src = yuyv + size_t(r)*cols*2;
+            // row sized buffer stays in L1 between decode and conversion
+            if(channels_ == 1) {
+                for(int i=0;i<cols;i++)
+                    row[i] = src[2*i];
+            }
+            else {
+                yuyv2rgb(src,row,cols);
+            }
+            calibration_.apply_row(r,row,linear,frame.ptr<float>(r),cols * channels_);
+        }
+        return frame;
+    }
+    // calibration data must be up to date, see update_calibration()
+    cv::Mat calibrate(Scratch &s,int format,void const *data)
+    {
+        switch(format) {
+        case STACKER_FORMAT_MONO16: return calibrate_16bit(s,static_cast<unsigned short const *>(data));
+        case STACKER_FORMAT_YUYV: return calibrate_yuyv(s,static_cast<unsigned char const *>(data));
+        default: return calibrate_8bit(s,static_cast<unsigned char const *>(data));
+        }
+    }
+    // exposure averaging followed by calibration
+    bool stack_float(cv::Mat frame_in,bool restart_position,float rotate)
+    {
+        cv::Mat frame = frame_in;
         if(exp_multiplier_ != 1) {
+            scratch(manual_frame_,frame_in.rows,frame_in.cols,frame_in.type());
             if(manual_exposure_counter_ == 0)
-                manual_frame_ = frame;
+                frame_in.copyTo(manual_frame_);
             else
-                manual_frame_ += frame;
+                cv::add(manual_frame_,frame_in,manual_frame_);
             manual_exposure_counter_++;
             if(manual_exposure_counter_ < exp_multiplier_)
                 return true;
             manual_exposure_counter_ = 0;
-            frame = manual_frame_ * (1.0f / exp_multiplier_);
+            manual_frame_.convertTo(sync_.input,CV_32F,1.0f / exp_multiplier_);
+            frame = sync_.input;
         }
-        if(src_gamma_ != 1.0) {
-            cv::pow(frame,src_gamma_,frame);
+        update_calibration();
+        return stack_calibrated(calibrate_float(sync_,frame),restart_position,rotate);
+    }
+    // gamma tables and calibration planes for current settings, workers only read them
+    void update_calibration()
+    {
+        calibration_.update(src_gamma_);
+        if(gamma_lut_gamma_ == src_gamma_)
+            return;
+        for(int i=0;i<256;i++)
+            gamma_lut_[i] = src_gamma_ == 1.0f ? i / 255.0f : std::pow(i / 255.0f,src_gamma_);
+        gamma_lut16_.resize(65536);
+        for(int i=0;i<65536;i++)
+            gamma_lut16_[i] = std::pow(i / 65535.0f,src_gamma_);
+        gamma_lut_gamma_ = src_gamma_;
+    }
+    bool stack_calibrated(cv::Mat frame,bool restart_position,float rotate)
+    {
+        if(window_size_ == 0)
+            return accumulate(frame,cv::Point2f(0,0),restart_position,false,nullptr);
+        if(rotate!=0) {
+            // same as getRotationMatrix2D but without allocating the matrix
+            double a = std::cos(rotate * CV_PI / 180);
+            double b = std::sin(rotate * CV_PI / 180);
+            double cx = frame.cols/2;
+            double cy = frame.rows/2;
+            cv::Matx23d M(a,b,(1-a)*cx - b*cy,
+                          -b,a,b*cx + (1-a)*cy);
+            cv::Mat &frame_rotated = scratch(sync_.rotated,frame.rows,frame.cols,frame.type());
+            cv::warpAffine(frame,frame_rotated,M,cv::Size(frame.cols,frame.rows));
+            frame = frame_rotated;
         }
-        else {
-            frame = frame_in.clone();
+        if(frames_ == 0) {
+            registrator_.set_reference(frame);
+            if(tile_size_ > 0)
+                tiles_.set_reference(frame,tile_correlators_[0]);
+            return accumulate(frame,cv::Point2f(0,0),restart_position,false,nullptr);
         }
-        if(has_darks_) {
-            if(src_gamma_ != 1.0) { 
-                if(!darks_corrected_) {
-                    darks_corrected_ = true;
-                    cv::pow(darks_,src_gamma_,darks_gamma_corrected_);
-                }
-                //frame = cv::max(frame - darks_gamma_corrected_,0);
-                frame = frame - darks_gamma_corrected_;
+        bool trusted;
+        cv::Point2f shift = registrator_.find_shift(frame,predict_shift(1),trusted);
+        if(tile_size_ == 0)
+            return accumulate(frame,shift,restart_position,trusted,nullptr);
+        find_tile_offsets(frame,shift);
+        return accumulate(frame,shift,restart_position,trusted,offsets_.data());
+    }
+    // parallel_for_ over stripes calling f directly, the std::function overload heap
+    // allocates for captures larger than a couple of pointers on every call
+    template<typename F>
+    static void parallel_stripes(int stripes,F const &f)
+    {
+        struct Body : cv::ParallelLoopBody {
+            explicit Body(F const &f) : f_(f) {}
+            void operator()(cv::Range const &range) const override { f_(range); }
+            F const &f_;
+        } body(f);
+        cv::parallel_for_(cv::Range(0,stripes),body,stripes);
+    }
+    // tiles are split over parallel stripes, each with its own correlator
+    void find_tile_offsets(cv::Mat const &frame,cv::Point2f shift)
+    {
+        int stripes = tile_correlators_.size();
+        int n = tiles_.tiles();
+        parallel_stripes(stripes,[&](cv::Range const &range) {
+            for(int s=range.start;s<range.end;s++)
+                tiles_.find_offsets(frame,shift,n * s / stripes,n * (s + 1) / stripes,tile_correlators_[s],offsets_.data());
+        });
+    }
+    // registered frame in stacking order, trusted shift is accepted even if it jumps
+    // away from the tracked position. Tile offsets are relative to shift, null for global
+    // alignment only
+    bool accumulate(cv::Mat frame,cv::Point2f shift,bool restart_position,bool trusted,cv::Point2f const *offsets)
+    {
+        std::lock_guard<std::mutex> guard(sum_lock_);
+        if(window_size_ == 0) {
+            add_image(frame,shift);
+            frames_ ++;
+            return true;
+        }
+        bool added = true;
+        if(frames_ == 0 || restart_position) {
+            reset_step(shift);
+        }
+        else if(!check_step(shift)) {
+            if(trusted) {
+                LOG("tracking jump to dx=%5.2f dy=%5.2f\n",shift.x,shift.y);
+                reset_step(shift);
             }
             else {
-                //frame = cv::max(frame - darks_,0);
-                frame = frame - darks_;
+                LOG("failed registration dx=%5.2f dy=%5.2f\n",shift.x,shift.y);
+                added = false;
             }
         }
-        if(window_size_ == 0) {
-            add_image(frame,cv::Point(0,0));
+        // workers predict from the new position while the frame is being added
+        publish_tracking();
+        if(added) {
+            add_image(frame,shift,frames_ == 0 ? nullptr : offsets);
             frames_ ++;
-            return true;
         }
-        if(rotate!=0) {
-            auto M = cv::getRotationMatrix2D(cv::Point2f(frame.cols/2,frame.rows/2),rotate,1.0f);
-            cv::Mat frame_rotated;
-            cv::warpAffine(frame,frame_rotated,M,cv::Size(frame.cols,frame.rows));
-            frame = frame_rotated;
+        return added;
+    }
+    // first frame defines the reference all workers register against, it is stacked
+    // synchronously once the pipeline is idle
+    int submit_reference(int format,void const *data,bool restart_position)
+    {
+        wait_pipeline();
+        bool added = stack_calibrated(calibrate(sync_,format,data),restart_position,0);
+        for(auto &r : registrators_) {
+            if(window_size_ > 0)
+                r.copy_reference(registrator_);
         }
-        bool added = true;
-        if(frames_ == 0) {
-            add_image(frame,cv::Point(0,0));
-            fft_roi_ = calc_fft(frame);
-            frames_ = 1;
-            reset_step(cv::Point(0,0));
+        has_reference_ = true;
+        int id;
+        {
+            std::unique_lock<std::mutex> guard(pipeline_lock_);
+            id = submitted_++;
+            next_take_ = next_done_ = submitted_;
         }
-        else {
-            cv::Mat fft_frame = calc_fft(frame);
-            cv::Point shift = get_dx_dy(fft_frame);
-            if(restart_position) {
-                add_image(frame,shift);
-                reset_step(shift);
-                frames_ ++;
+        if(callback_)
+            callback_(callback_data_,id,added);
+        return id;
+    }
+    void worker_thread(int worker)
+    {
+        std::unique_lock<std::mutex> guard(pipeline_lock_);
+        while(true) {
+            // ids are reserved before frames are copied, jobs are taken in id order once filled
+            pipeline_cond_.wait(guard,[&]{
+                return stop_ || (next_take_ < submitted_ && jobs_[next_take_ % jobs_.size()].state == JOB_QUEUED);
+            });
+            if(stop_)
+                return;
+            Job &job = jobs_[next_take_++ % jobs_.size()];
+            // frames between the last accumulated one and this
+            int ahead = job.id - next_done_ + 1;
+            guard.unlock();
+            try {
+                job.error.clear();
+                job.frame = calibrate(job.scratch,job.format,job.data.data());
+                job.trusted = false;
+                if(window_size_ > 0)
+                    job.shift = registrators_[worker].find_shift(job.frame,predict_shift(ahead),job.trusted);
+                else
+                    job.shift = cv::Point2f(0,0);
+                if(tile_size_ > 0)
+                    tiles_.find_offsets(job.frame,job.shift,0,tiles_.tiles(),worker_tile_correlators_[worker],job.offsets.data());
+            }
+            catch(std::exception const &e) {
+                job.error = e.what();
+            }
+            guard.lock();
+            job.state = JOB_REGISTERED;
+            pipeline_cond_.notify_all();
+        }
+    }
+    void accumulator_thread()
+    {
+        std::unique_lock<std::mutex> guard(pipeline_lock_);
+        while(true) {
+            pipeline_cond_.wait(guard,[&]{
+                return stop_ || (next_done_ < submitted_ && jobs_[next_done_ % jobs_.size()].state == JOB_REGISTERED);
+            });
+            if(stop_)
+                return;
+            Job &job = jobs_[next_done_ % jobs_.size()];
+            guard.unlock();
+            int result;
+            if(!job.error.empty()) {
+                snprintf(error_message_,sizeof(error_message_),"Failed: %s",job.error.c_str());
+                result = -1;
             }
             else {
-                if(check_step(shift)) {
-                    add_image(frame,shift);
-                    frames_ ++;
+                try {
+                    result = accumulate(job.frame,job.shift,job.restart,job.trusted,tile_size_ > 0 ? job.offsets.data() : nullptr);
                 }
-                else {
-                    LOG("failed registration dx=%d dy=%d\n",shift.x,shift.y);
-                    added = false;
+                catch(std::exception const &e) {
+                    snprintf(error_message_,sizeof(error_message_),"Failed: %s",e.what());
+                    result = -1;
                 }
             }
+            if(callback_)
+                callback_(callback_data_,job.id,result);
+            guard.lock();
+            job.state = JOB_FREE;
+            next_done_++;
+            pipeline_cond_.notify_all();
         }
-        return added;
     }
-private:
 /*
     void calc_scale_offset2(cv::Mat img,double scale[3],double offset[3],double &mean)
     {
@@ -372,17 +1049,23 @@ private:
     void stretch_high_factor(cv::Mat img,double &scale,double &mean)
     {
         cv::Mat tmp;
-        img.convertTo(tmp,CV_8UC3,255,0);
+        img.convertTo(tmp,CV_8U,255,0);
         int counters[256]={};
         int N=tmp.rows*tmp.cols;
         unsigned char *p=tmp.data;
-        for(int i=0;i<N;i++) {
-            unsigned R = *p++;
-            unsigned G = *p++;
-            unsigned B = *p++;
-            unsigned char Y = unsigned(0.3f * R + 0.6f * G + 0.1f * B);
-            counters[Y]++;
-    }
+        if(channels_ == 1) {
+            for(int i=0;i<N;i++)
+                counters[*p++]++;
+        }
+        else {
+            for(int i=0;i<N;i++) {
+                unsigned R = *p++;
+                unsigned G = *p++;
+                unsigned B = *p++;
+                unsigned char Y = unsigned(0.3f * R + 0.6f * G + 0.1f * B);
+                counters[Y]++;
+            }
+        }
         int sum=N;
         int hp=-1;
         for(int i=255;i>=0;i--) {
@@ -413,18 +1096,18 @@ private:
         cv::minMaxLoc(img,nullptr,&maxV);
         cv::Mat tmp;
         double a=255.0/maxV;
-        img.convertTo(tmp,CV_8UC3,a,0);
+        img.convertTo(tmp,CV_8U,a,0);
         int N=tmp.rows*tmp.cols;
         unsigned char *p=tmp.data;
         int counters[256][3]={};
         for(int i=0;i<N;i++) {
-            for(int j=0;j<3;j++) {
+            for(int j=0;j<channels_;j++) {
                counters[*p++][j]++;
             }
         }
         int loffset[3];
         double min_factor=1.0;
-        for(int color=0;color<3;color++) {
+        for(int color=0;color<channels_;color++) {
             int lp=-1,hp=-1;
             int sum=0;
             for(int i=0;i<255;i++) {
@@ -439,7 +1122,7 @@ private:
         }
         double meanv[3]={0,0,0};
         double maxmean = 0;
-        for(int color=0;color<3;color++) {
+        for(int color=0;color<channels_;color++) {
             int lp = loffset[color];
             int total=0;
             for(int i=lp;i<255;i++) {
@@ -451,7 +1134,7 @@ private:
             printf("mean %f[%d] %d\n",meanv[color],color,lp);
         }
         double wb_factor[3];
-        for(int color=0;color<3;color++) {
+        for(int color=0;color<channels_;color++) {
             wb_factor[color] = maxmean/meanv[color]*min_factor; 
             int lp = loffset[color];
             double L = maxV*lp/255;
@@ -513,14 +1196,38 @@ private:
         mean/=total;
     }
 
-    void reset_step(cv::Point p)
+    // tracked position is the forecast, the search radius grows with rms step like a random
+    // walk over the frames ahead. No prediction until tracking is steady
+    ShiftPrediction predict_shift(int ahead)
+    {
+        std::lock_guard<std::mutex> guard(tracking_lock_);
+        ShiftPrediction p;
+        if(!tracking_.steady)
+            return p;
+        // peak must be inside the searched area, so at least one pixel around a sub pixel shift
+        float radius = std::max(2.0f,std::ceil(2 * tracking_.step_avg * std::sqrt(float(ahead))) + 1);
+        if(radius > Registrator::max_local_radius)
+            return p;
+        p.position = tracking_.position;
+        p.radius = int(radius);
+        return p;
+    }
+    // snapshot of tracking state for predict_shift, workers never wait for sum planes
+    void publish_tracking()
+    {
+        std::lock_guard<std::mutex> guard(tracking_lock_);
+        tracking_.position = current_position_;
+        tracking_.steady = count_frames_ >= 3 && missed_frames_ == 0;
+        tracking_.step_avg = tracking_.steady ? std::sqrt(step_sum_sq_ / count_frames_) : 0.0f;
+    }
+    void reset_step(cv::Point2f p)
     {
         current_position_ = p;
         step_sum_sq_ = 0;
         count_frames_ = 0;
         missed_frames_ = 0;
     }
-    bool check_step(cv::Point p)
+    bool check_step(cv::Point2f p)
     {
         float dx = current_position_.x - p.x;
         float dy = current_position_.y - p.y;
@@ -539,7 +1246,7 @@ private:
             float step = sqrt(step_sq_);
             float step_limit = std::max((2 + (float)sqrt(missed_frames_)) * step_avg_,pixel_0_threshold);
 #ifdef DEBUG            
-            printf("Step size %5.2f from (%d,%d) to (%d,%d) limit =%5.1f avg_step=%5.1f\n",step,
+            printf("Step size %5.2f from (%5.2f,%5.2f) to (%5.2f,%5.2f) limit =%5.1f avg_step=%5.1f\n",step,
                     current_position_.x,current_position_.y,
                     p.x,p.y,
                     step_limit,step_avg_);
@@ -558,82 +1265,32 @@ private:
         }
     }
 
-    int fft_pos(int x)
-    {
-        if(x > window_size_ / 2)
-            return x - window_size_;
-        else
-            return x;
-    }
-    cv::Point get_dx_dy(cv::Mat dft)
-    {
-        cv::Mat res,shift;
-        cv::mulSpectrums(fft_roi_,dft,res,0,true);
-        cv::Mat dspec;
-        cv::divSpectrums(res,cv::abs(res),dspec,0);
-        cv::idft(dspec,shift,cv::DFT_REAL_OUTPUT);
-        cv::Point pos;
-#ifdef DEBUG
-        double minv,maxv;
-        cv::minMaxLoc(shift,&minv,&maxv,nullptr,&pos);
-        static int n=1;
-        cv::Mat a,b;
-        a=255*(shift-minv)/(maxv-minv);
-        a.convertTo(b,CV_8UC1);
-        imwritergb(std::to_string(n++) + "_shift.png",b);
-#else
-        cv::minMaxLoc(shift,nullptr,nullptr,nullptr,&pos);
-        #if 0
-            std::vector<float> vec(shift.cols);
-            for(int r=0;r<shift.rows;r++) {
-                for(int c=0;c<shift.cols;c++) {
-                    vec[r]+=shift.at<float>(r,c);
-                }
-            }
-            int maxp = 0;
-            float maxv = vec[0];
-            for(unsigned i=1;i<vec.size();i++) {
-                if(vec[i] > maxv) {
-                    maxv = vec[i];
-                    maxp=i;
-                }
-            }
-            pos.y = maxp;
-            pos.x = 0;
-            printf("Shift = %d\n",fft_pos(maxp));
-        #endif
-#endif        
-        return cv::Point(fft_pos(pos.x),fft_pos(pos.y));
-    }
-
-    cv::Mat calc_fft(cv::Mat frame)
+    // sum(x,y) += img(x - shift.x,y - shift.y), fractional shift is interpolated bilinearly
+    // in the same pass, integer part only moves the rectangles. With tile offsets the shift
+    // changes per pixel, see add_image_tiles
+    void add_image(cv::Mat img,cv::Point2f shift,cv::Point2f const *offsets = nullptr)
     {
-        cv::Mat rgb[3],gray,dft;
-        cv::Mat roi = cv::Mat(frame,cv::Rect(dx_,dy_,window_size_,window_size_));
-        cv::split(roi,rgb);
-        rgb[1].convertTo(gray,CV_32FC1);
-        cv::dft(gray,dft,cv::DFT_COMPLEX_OUTPUT);
-        cv::mulSpectrums(dft,fft_kern_,dft,0);
-#ifdef DEBUG
-        {
-            cv::idft(dft,gray,cv::DFT_REAL_OUTPUT);
-            double minv,maxv;
-            cv::minMaxLoc(gray,&minv,&maxv);
-            gray = (gray - minv)/(maxv-minv)*255;
-            cv::Mat tmp;
-            gray.convertTo(tmp,CV_8UC1);
-            static int n=1;
-            imwritergb(std::to_string(n++) + "_b.png",tmp);
+        if(offsets) {
+            if(kappa_ > 0)
+                add_image_tiles<true>(img,shift,offsets);
+            else
+                add_image_tiles<false>(img,shift,offsets);
+            return;
+        }
+        int dx = cvFloor(shift.x);
+        int dy = cvFloor(shift.y);
+        float fx = shift.x - dx;
+        float fy = shift.y - dy;
+        LOG("Adding at %5.2f %5.2f\n",shift.x,shift.y);
+        // rejection needs per pixel update, integer shift is the same loop with zero weights
+        if(kappa_ > 0) {
+            add_image_subpixel<true>(img,dx,dy,fx,fy);
+            return;
+        }
+        if(fx != 0 || fy != 0) {
+            add_image_subpixel<false>(img,dx,dy,fx,fy);
+            return;
         }
-#endif        
-        return dft;
-    }
-
-    void add_image(cv::Mat img,cv::Point shift)
-    {
-        int dx = shift.x;
-        int dy = shift.y;
-        LOG("Adding at %d %d\n",dx,dy);
         int width  = (sum_.cols - std::abs(dx));
         int height = (sum_.rows - std::abs(dy));
         cv::Rect src_rect = cv::Rect(std::max(dx,0),std::max(dy,0),width,height);
@@ -643,24 +1300,182 @@ private:
         fully_stacked_area_ = fully_stacked_area_ & src_rect;
         fully_stacked_count_++;
     }
+    // Welford update of one sample unless it is beyond kappa sigma, sum = mean * count so
+    // only the squared deviations need an extra plane. Rejection starts once the variance
+    // is meaningful, earlier it clips too many good samples
+    static constexpr float rejection_min_frames = 10;
+    static void add_sample(float &sum,float &count,float &m2,float v,float kappa2)
+    {
+        float n = count;
+        // no branches so the loops calling it stay vectorized
+        float mean = sum / std::max(n,1.0f);
+        float var = m2 / std::max(n - 1,1.0f);
+        float dev = v - mean;
+        float keep = (n < rejection_min_frames) | (dev * dev <= kappa2 * var) ? 1.0f : 0.0f;
+        float n1 = n + keep;
+        float s1 = sum + keep * v;
+        m2 += keep * dev * (v - s1 / std::max(n1,1.0f));
+        sum = s1;
+        count = n1;
+    }
+    template<bool Reject>
+    void add_image_subpixel(cv::Mat img,int dx,int dy,float fx,float fy)
+    {
+        // pixels that also need left/top neighbour for interpolation
+        int kx = fx > 0 ? 1 : 0;
+        int ky = fy > 0 ? 1 : 0;
+        int x0 = std::max(dx + kx,0);
+        int y0 = std::max(dy + ky,0);
+        int x1 = std::min(sum_.cols + dx,sum_.cols);
+        int y1 = std::min(sum_.rows + dy,sum_.rows);
+        if(x1 <= x0 || y1 <= y0)
+            return;
+        float w00 = (1 - fx) * (1 - fy);
+        float w01 = fx * (1 - fy);
+        float w10 = (1 - fx) * fy;
+        float w11 = fx * fy;
+        int ch = channels_;
+        int left = kx * ch;
+        int n = (x1 - x0) * ch;
+        float kappa2 = kappa_ * kappa_;
+        for(int y=y0;y<y1;y++) {
+            float *__restrict s = sum_.ptr<float>(y) + x0 * ch;
+            float const *__restrict a = img.ptr<float>(y - dy) + (x0 - dx) * ch;
+            float const *__restrict b = img.ptr<float>(y - dy - ky) + (x0 - dx) * ch;
+            // contiguous over pixels and channels, vectorized by the compiler
+            if(Reject) {
+                float *__restrict c = count_.ptr<float>(y) + x0 * ch;
+                float *__restrict m = m2_.ptr<float>(y) + x0 * ch;
+                for(int i=0;i<n;i++)
+                    add_sample(s[i],c[i],m[i],w00 * a[i] + w01 * a[i - left] + w10 * b[i] + w11 * b[i - left],kappa2);
+            }
+            else {
+                for(int i=0;i<n;i++)
+                    s[i] += w00 * a[i] + w01 * a[i - left] + w10 * b[i] + w11 * b[i - left];
+            }
+        }
+        cv::Rect rect(x0,y0,x1 - x0,y1 - y0);
+        if(!Reject)
+            cv::Mat(count_,rect) += cv::Scalar(1,1,1);
+        fully_stacked_area_ = fully_stacked_area_ & rect;
+        fully_stacked_count_++;
+    }
+    // sum(x,y) += img((x,y) - shift - offset(x,y)) sampled bilinearly, offset is interpolated
+    // between tile centres. Rows are split over parallel stripes
+    template<bool Reject>
+    void add_image_tiles(cv::Mat img,cv::Point2f shift,cv::Point2f const *offsets)
+    {
+        float kappa2 = kappa_ * kappa_;
+        int stripes = tile_rows_.size();
+        int rows = sum_.rows;
+        int cols = sum_.cols;
+        int ch = channels_;
+        parallel_stripes(stripes,[&](cv::Range const &range) {
+            for(int s=range.start;s<range.end;s++) {
+                cv::Point2f *row = tile_rows_[s].data();
+                for(int y=rows * s / stripes;y<rows * (s + 1) / stripes;y++) {
+                    tiles_.row_offsets(offsets,y,row);
+                    float *sum = sum_.ptr<float>(y);
+                    float *count = count_.ptr<float>(y);
+                    float *m2 = Reject ? m2_.ptr<float>(y) : nullptr;
+                    for(int x=0;x<cols;x++) {
+                        float sx = x - shift.x - row[x].x;
+                        float sy = y - shift.y - row[x].y;
+                        int ix = cvFloor(sx);
+                        int iy = cvFloor(sy);
+                        if(ix < 0 || iy < 0 || ix + 1 >= cols || iy + 1 >= rows)
+                            continue;
+                        float fx = sx - ix;
+                        float fy = sy - iy;
+                        float const *a = img.ptr<float>(iy) + ix * ch;
+                        float const *b = img.ptr<float>(iy + 1) + ix * ch;
+                        for(int c=0;c<ch;c++) {
+                            int i = x * ch + c;
+                            float v = (1 - fy) * ((1 - fx) * a[c] + fx * a[c + ch])
+                                    + fy * ((1 - fx) * b[c] + fx * b[c + ch]);
+                            if(Reject) {
+                                add_sample(sum[i],count[i],m2[i],v,kappa2);
+                            }
+                            else {
+                                sum[i] += v;
+                                count[i] += 1;
+                            }
+                        }
+                    }
+                }
+            }
+        });
+        // area covered for any offset up to the largest one
+        float limit = 0;
+        for(int t=0;t<tiles_.tiles();t++)
+            limit = std::max(limit,std::max(std::abs(offsets[t].x),std::abs(offsets[t].y)));
+        int x0 = std::max(0,int(std::ceil(shift.x + limit)));
+        int y0 = std::max(0,int(std::ceil(shift.y + limit)));
+        int x1 = std::min(cols,int(std::floor(cols - 2 + shift.x - limit)) + 1);
+        int y1 = std::min(rows,int(std::floor(rows - 2 + shift.y - limit)) + 1);
+        fully_stacked_area_ = fully_stacked_area_ & cv::Rect(x0,y0,std::max(0,x1 - x0),std::max(0,y1 - y0));
+        fully_stacked_count_++;
+    }
     int frames_;
-    bool has_darks_;
     cv::Rect fully_stacked_area_;
     int fully_stacked_count_ = 0;
     cv::Mat sum_;
-    cv::Mat darks_;
-    cv::Mat darks_gamma_corrected_;
-    bool darks_corrected_ = false;
     cv::Mat count_;
-    cv::Mat fft_kern_;
-    cv::Mat fft_roi_;
-    cv::Point current_position_;
+    Registrator registrator_;
+    cv::Point2f current_position_;
     int count_frames_,missed_frames_;
     float step_sum_sq_;
     int dx_,dy_,window_size_;
     int manual_exposure_counter_ = 0;
     int exp_multiplier_;
+    int channels_;
     cv::Mat manual_frame_;
+    // per frame buffers of synchronous calls, see scratch()
+    Scratch sync_;
+    std::atomic<int> allocations_{0};
+    // pipeline, jobs_ is a ring indexed by frame id, state changes under pipeline_lock_
+    std::vector<Job> jobs_;
+    std::vector<Registrator> registrators_;  // per worker, plans are not thread safe
+    std::vector<std::thread> threads_;
+    std::mutex pipeline_lock_;
+    std::condition_variable pipeline_cond_;
+    std::mutex sum_lock_;
+    struct Tracking {
+        cv::Point2f position;
+        float step_avg = 0;
+        bool steady = false;
+    };
+    Tracking tracking_;  // guarded by tracking_lock_, see publish_tracking()
+    std::mutex tracking_lock_;
+    std::mutex submit_lock_;
+    int submitted_ = 0;
+    int next_take_ = 0;
+    int next_done_ = 0;
+    bool stop_ = false;
+    bool has_reference_ = false;
+    stacker_callback_type callback_ = nullptr;
+    void *callback_data_ = nullptr;
+    // squared deviations from the mean for kappa-sigma rejection, see add_sample
+    float kappa_ = 0;
+    cv::Mat m2_;
+    // multi point alignment, see set_tiles()
+    int tile_size_ = 0;
+    TileAligner tiles_;
+    std::vector<PhaseCorrelator> tile_correlators_;         // per parallel stripe
+    std::vector<std::vector<cv::Point2f>> tile_rows_;       // per parallel stripe
+    std::vector<cv::Point2f> offsets_;
+    std::vector<PhaseCorrelator> worker_tile_correlators_;  // per pipeline worker
+    // lucky imaging buffer, see select()
+    std::vector<Selected> selected_;
+    int selected_count_ = 0;
+    int select_sequence_ = 0;
+    int restart_epoch_ = 0;
+    int stacked_epoch_ = 0;
+    // bias, darks and flats, see update_calibration()
+    Calibration calibration_;
+    float gamma_lut_[256];
+    std::vector<float> gamma_lut16_;
+    float gamma_lut_gamma_ = -1.0f;
     float src_gamma_ = 1.0f;
     float tgt_gamma_ = 1.0f;
     bool enable_stretch_ = true;
@@ -716,18 +1531,59 @@ void test()
 }
 
 
-void make_darks(std::vector<cv::Mat> &pictures,std::vector<unsigned char> &data,int H,int W)
+#ifdef DO_STACK
+// per pixel percentile of image files, binary PPM files are mapped, others decoded in memory
+void median_images(char **paths,int N,float percentile,std::vector<unsigned char> &data,int H,int W)
 {
-    int N=pictures.size();
-    std::vector<unsigned char> buffer(N);
-    for(int p=0;p<H*W*3;p++) {
-        for(int j=0;j<N;j++) {
-            buffer[j] = ((unsigned char *)(pictures[j].data))[p];
-            std::nth_element(buffer.begin(),buffer.begin()+N/2,buffer.end());
-            data[p] = buffer[N/2];
+    MedianStacker median(W,H,3,1);
+    // decoded frames are spooled to an unlinked file and mapped like PPM ones,
+    // memory does not grow with frame count
+    char const *tmpdir = getenv("TMPDIR");
+    std::string spool = std::string(tmpdir ? tmpdir : "/tmp") + "/median_XXXXXX";
+    int fd = mkstemp(&spool[0]);
+    if(fd < 0)
+        throw std::runtime_error("Failed to create median spool file");
+    int spooled = 0;
+    for(int i=0;i<N;i++) {
+        // restart markers of the stacking command line are not frames
+        if(paths[i]==std::string("restart"))
+            continue;
+        std::ifstream f(paths[i],std::ios::binary);
+        std::string magic;
+        int w=0,h=0,maxval=0;
+        f >> magic >> w >> h >> maxval;
+        if(f && magic == "P6" && w == W && h == H && maxval == 255) {
+            f.get(); // single whitespace before raster
+            median.add_file(paths[i],size_t(f.tellg()),1);
+            continue;
+        }
+        cv::Mat img = imreadrgb(paths[i]);
+        if(img.empty() || img.rows != H || img.cols != W) {
+            printf("Skipping %s\n",paths[i]);
+            continue;
         }
+        size_t bytes = img.total() * img.elemSize();
+        if(write(fd,img.data,bytes) != ssize_t(bytes)) {
+            close(fd);
+            unlink(spool.c_str());
+            throw std::runtime_error("Failed to write median spool file");
+        }
+        spooled++;
+    }
+    close(fd);
+    // mapping stays valid after unlink, the file goes away with it
+    try {
+        if(spooled > 0)
+            median.add_file(spool,0,spooled);
+    }
+    catch(...) {
+        unlink(spool.c_str());
+        throw;
     }
+    unlink(spool.c_str());
+    median.compute(percentile,data.data());
 }
+#endif
 
 
 #ifdef DO_STACK
@@ -759,6 +1615,8 @@ int main(int argc,char **argv)
     else {
         std::string darks_path;
         std::string save_darks;
+        std::string bias_path;
+        std::string flat_path;
         std::string output;
         bool has_darks=false;
         float src_gamma=1.0;
@@ -771,12 +1629,18 @@ int main(int argc,char **argv)
         bool restart_full = false;
         int mpl = 1;
         int roi=-1;
+        float keep_percent = 0;
+        float median_percent = -1;
         while(argc >= 3 && argv[1][0]=='-') {
             std::string param=argv[1];
             if(param == "-d") {
                 darks_path=argv[2];
                 has_darks = true;
             }
+            else if(param == "-b")
+                bias_path = argv[2];
+            else if(param == "-F")
+                flat_path = argv[2];
             else if(param == "-D") {
                 save_darks = argv[2];
                 roi = 0;
@@ -811,6 +1675,10 @@ int main(int argc,char **argv)
                 src_gamma = atof(argv[2]);
             else if(param == "-G")
                 tgt_gamma = atof(argv[2]);
+            else if(param == "-q")
+                keep_percent = atof(argv[2]);
+            else if(param == "--median")
+                median_percent = atof(argv[2]);
             else {
                 printf("Unknown flag %s\n",param.c_str());
                 return 1;
@@ -821,10 +1689,17 @@ int main(int argc,char **argv)
         cv::Mat picture0 = imreadrgb(argv[1]);;
         int H=picture0.rows;
         int W=picture0.cols;
+        if(median_percent >= 0) {
+            // master darks or background, frames are not registered
+            std::vector<unsigned char> data(H*W*3);
+            median_images(argv + 1,argc - 1,median_percent,data,H,W);
+            save_ppm(output.empty() ? "res.ppm" : output.c_str(),data.data(),H,W);
+            return 0;
+        }
         Derotator dr(lat_d,lon_d);
         Stacker stacker(W,H,-1,-1,roi,mpl);
         if(has_darks) {
-            if(darks_path.find(".flt")!=std::string::npos) {
+            if(darks_path.find(".flt")!=std::string::npos || darks_path.find(".mst")!=std::string::npos) {
                 stacker.load_darks(darks_path.c_str());
             }
             else {
@@ -836,16 +1711,40 @@ int main(int argc,char **argv)
                 stacker.set_darks((unsigned char *)darks.data);
             }
         }
+        std::pair<std::string,int> masters[] = {{bias_path,STACKER_MASTER_BIAS},{flat_path,STACKER_MASTER_FLAT}};
+        for(auto const &m : masters) {
+            if(m.first.empty())
+                continue;
+            cv::Mat img = imreadrgb(m.first);
+            if(H != img.rows || W != img.cols) {
+                printf("Invalid master size %s\n",m.first.c_str());
+                return 1;
+            }
+            stacker.add_master(m.second,STACKER_FORMAT_RGB,img.data,-1,-1);
+        }
         stacker.set_source_gamma(src_gamma);
         stacker.set_target_gamma(tgt_gamma);
-        /*std::vector<unsigned char> darks(H*W*3);
-        make_darks(pictures,darks,W,H);
-        stacker.set_darks(darks.data());
-        {
-            std::ofstream tmp("darks.ppm");
-            tmp<<"P6\n"<<W<<" " << H << " 255\n";
-            tmp.write((char*)darks.data(),3*H*W);
-        }*/
+        // lucky imaging in two passes: score all frames, stack the sharpest keep_percent
+        std::vector<float> scores(argc,-1);
+        float min_score = 0;
+        if(keep_percent > 0) {
+            std::vector<float> valid;
+            for(int i=2;i<argc;i++) {
+                if(argv[i]==std::string("restart"))
+                    continue;
+                cv::Mat img = imreadrgb(argv[i]);
+                if(img.rows != H || img.cols != W)
+                    continue;
+                scores[i] = stacker.score(STACKER_FORMAT_RGB,img.data);
+                valid.push_back(scores[i]);
+            }
+            if(!valid.empty()) {
+                int keep = std::max(1,int(valid.size() * std::min(keep_percent,100.0f) / 100));
+                std::nth_element(valid.begin(),valid.begin() + (valid.size() - keep),valid.end());
+                min_score = valid[valid.size() - keep];
+            }
+            printf("Keeping frames with score >= %f\n",min_score);
+        }
         bool flag=false;
         for(int i=2;i<argc;i++) {
             if(argv[i]==std::string("restart")) {
@@ -859,6 +1758,9 @@ int main(int argc,char **argv)
                 printf("Skipping %s\n",argv[i]);
                 continue;
             }
+            // restart flag is kept for the next stacked frame
+            if(keep_percent > 0 && scores[i] < min_score)
+                continue;
             float angle = 0;
             if(start_time != 0) {
                 double ts = (duration * (i-2))/(argc-4) + start_time;
@@ -894,10 +1796,102 @@ int main(int argc,char **argv)
 
 #else
 
+#if defined(__GLIBC__)
+#include <cerrno>
+// every heap allocation of the process is counted, operator new and OpenCV end up here
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n,size_t size);
+void *__libc_realloc(void *p,size_t size);
+void *__libc_memalign(size_t alignment,size_t size);
+void __libc_free(void *p);
+}
+static std::atomic<long> heap_allocations(0);
+extern "C" {
+void *malloc(size_t size)
+{
+    heap_allocations++;
+    return __libc_malloc(size);
+}
+void *calloc(size_t n,size_t size)
+{
+    heap_allocations++;
+    return __libc_calloc(n,size);
+}
+void *realloc(void *p,size_t size)
+{
+    heap_allocations++;
+    return __libc_realloc(p,size);
+}
+void *memalign(size_t alignment,size_t size)
+{
+    heap_allocations++;
+    return __libc_memalign(alignment,size);
+}
+void *aligned_alloc(size_t alignment,size_t size)
+{
+    heap_allocations++;
+    return __libc_memalign(alignment,size);
+}
+int posix_memalign(void **p,size_t alignment,size_t size)
+{
+    heap_allocations++;
+    *p = __libc_memalign(alignment,size);
+    return *p ? 0 : ENOMEM;
+}
+void free(void *p)
+{
+    __libc_free(p);
+}
+}
+
+// stacks frames with tiles and rejection, once warmed up further frames must not touch the heap
+int test_allocations()
+{
+    constexpr int H=240;
+    constexpr int W=320;
+    constexpr int warmup = 3;
+    constexpr int frames = 20;
+    std::vector<unsigned char> img(H*W*3);
+    Stacker s(W,H,-1,-1,64);
+    s.set_tiles(32);
+    s.set_rejection(3);
+    s.set_source_gamma(2.2);
+    long heap_before = 0;
+    int allocations_before = 0;
+    for(int i=0;i<warmup + frames;i++) {
+        if(i == warmup) {
+            heap_before = heap_allocations;
+            allocations_before = s.allocations();
+        }
+        unsigned char *pos = img.data();
+        for(int r=0;r<H;r++) {
+            for(int c=0;c<W;c++) {
+                int dx = r - (H/2 + i % 5);
+                int dy = c - (W/2 - i % 3);
+                int v = dx*dx + dy*dy < 20*20 ? 150 : 0;
+                for(int k=0;k<3;k++)
+                    *pos++ = v + rand() % 50;
+            }
+        }
+        s.stack_image(img.data());
+    }
+    long heap = heap_allocations - heap_before;
+    int own = s.allocations() - allocations_before;
+    printf("Heap allocations over %d frames: %ld, frame buffer reallocations: %d\n",frames,heap,own);
+    return heap == 0 && own == 0 ? 0 : 1;
+}
+#else
+int test_allocations()
+{
+    return 0;
+}
+#endif
+
 int main()
 {
     test();
-    return 0;
+    return test_allocations();
 }
 
 #endif
@@ -919,6 +1913,56 @@ extern "C" {
             return 0;
         }
     }
+    Stacker *stacker_new_mono(int w,int h,int roi_x,int roi_y,int roi_size)
+    {
+        try {
+            LOG("Creating mono stacker of size %d,%d roi=%d",w,h,roi_size);
+            return new Stacker(w,h,roi_x,roi_y,roi_size,1,1);
+        }
+        catch(std::exception const &e) {
+            snprintf(Stacker::error_message_,sizeof(Stacker::error_message_),"Failed to create stacker %s",e.what());
+            return 0;
+        }
+        catch(...) {
+            snprintf(Stacker::error_message_,sizeof(Stacker::error_message_),"Unknown exceptiopn");
+            return 0;
+        }
+    }
+    int stacker_start_pipeline(Stacker *obj,int threads,int queue_depth,stacker_callback_type callback,void *user_data)
+    {
+        try {
+            obj->start_pipeline(threads,queue_depth,callback,user_data);
+        }
+        catch(std::exception const &e) {
+            snprintf(obj->error_message_,sizeof(obj->error_message_),"Failed: %s",e.what());
+            return -1;
+        }
+        catch(...) { strcpy(obj->error_message_,"Unknown exceptiopn"); return -1; }
+        return 0;
+    }
+    int stacker_submit(Stacker *obj,int format,void const *data,int restart)
+    {
+        try {
+            return obj->submit(format,data,restart);
+        }
+        catch(std::exception const &e) {
+            snprintf(obj->error_message_,sizeof(obj->error_message_),"Failed: %s",e.what());
+            return -1;
+        }
+        catch(...) { strcpy(obj->error_message_,"Unknown exceptiopn"); return -1; }
+    }
+    int stacker_pending(Stacker *obj)
+    {
+        return obj->pending();
+    }
+    void stacker_wait(Stacker *obj)
+    {
+        obj->wait_pipeline();
+    }
+    void stacker_stop_pipeline(Stacker *obj)
+    {
+        obj->stop_pipeline();
+    }
     void stacker_delete(Stacker *obj)
     {
         delete obj;
@@ -946,6 +1990,28 @@ extern "C" {
         }
         catch(...) { strcpy(obj->error_message_,"Unknown exceptiopn"); return -1; }
     }
+    int stacker_stack_mono16(Stacker *obj,unsigned short *img,int restart)
+    {
+        try {
+            return obj->stack_image(img,restart);
+        }
+        catch(std::exception const &e) {
+            snprintf(obj->error_message_,sizeof(obj->error_message_),"Failed: %s",e.what());
+            return -1;
+        }
+        catch(...) { strcpy(obj->error_message_,"Unknown exceptiopn"); return -1; }
+    }
+    int stacker_stack_yuyv(Stacker *obj,unsigned char *yuyv,int restart)
+    {
+        try {
+            return obj->stack_yuyv(yuyv,restart);
+        }
+        catch(std::exception const &e) {
+            snprintf(obj->error_message_,sizeof(obj->error_message_),"Failed: %s",e.what());
+            return -1;
+        }
+        catch(...) { strcpy(obj->error_message_,"Unknown exceptiopn"); return -1; }
+    }
     
     int stacker_save_stacked_darks(Stacker *obj,char const *path)
     {
@@ -959,6 +2025,66 @@ extern "C" {
         catch(...) { strcpy(obj->error_message_,"Unknown exceptiopn"); return -1; }
         return 0;
     }
+    int stacker_add_master(Stacker *obj,int kind,int format,void const *data,float exposure_ms,float gain)
+    {
+        try {
+            obj->add_master(kind,format,data,exposure_ms,gain);
+        }
+        catch(std::exception const &e) {
+            snprintf(obj->error_message_,sizeof(obj->error_message_),"Failed: %s",e.what());
+            return -1;
+        }
+        catch(...) { strcpy(obj->error_message_,"Unknown exceptiopn"); return -1; }
+        return 0;
+    }
+    int stacker_clear_masters(Stacker *obj)
+    {
+        try {
+            obj->clear_masters();
+        }
+        catch(std::exception const &e) {
+            snprintf(obj->error_message_,sizeof(obj->error_message_),"Failed: %s",e.what());
+            return -1;
+        }
+        catch(...) { strcpy(obj->error_message_,"Unknown exceptiopn"); return -1; }
+        return 0;
+    }
+    int stacker_set_frame_settings(Stacker *obj,float exposure_ms,float gain)
+    {
+        try {
+            obj->set_frame_settings(exposure_ms,gain);
+        }
+        catch(std::exception const &e) {
+            snprintf(obj->error_message_,sizeof(obj->error_message_),"Failed: %s",e.what());
+            return -1;
+        }
+        catch(...) { strcpy(obj->error_message_,"Unknown exceptiopn"); return -1; }
+        return 0;
+    }
+    int stacker_save_master(Stacker *obj,char const *path,int kind,int sample_type,float temperature)
+    {
+        try {
+            obj->save_master(path,kind,sample_type,temperature);
+        }
+        catch(std::exception const &e) {
+            snprintf(obj->error_message_,sizeof(obj->error_message_),"Failed: %s",e.what());
+            return -1;
+        }
+        catch(...) { strcpy(obj->error_message_,"Unknown exceptiopn"); return -1; }
+        return 0;
+    }
+    int stacker_load_master(Stacker *obj,char const *path)
+    {
+        try {
+            obj->load_master(path);
+        }
+        catch(std::exception const &e) {
+            snprintf(obj->error_message_,sizeof(obj->error_message_),"Failed: %s",e.what());
+            return -1;
+        }
+        catch(...) { strcpy(obj->error_message_,"Unknown exceptiopn"); return -1; }
+        return 0;
+    }
     int stacker_load_darks(Stacker *obj,char const *path)
     {
         try {
@@ -985,6 +2111,109 @@ extern "C" {
         return 0;
     }
 
+    int stacker_get_allocations(Stacker *obj)
+    {
+        return obj->allocations();
+    }
+
+    int stacker_set_pyramid(Stacker *obj,int levels)
+    {
+        try {
+            obj->set_pyramid(levels);
+        }
+        catch(std::exception const &e) {
+            snprintf(obj->error_message_,sizeof(obj->error_message_),"Failed: %s",e.what());
+            return -1;
+        }
+        return 0;
+    }
+
+    int stacker_median_ser(char const *path,float percentile,void *out,size_t out_size)
+    {
+        try {
+            SerHeader h = read_ser_header(path);
+            MedianStacker median(h.width,h.height,h.channels,h.bytes_per_sample);
+            if(out_size < median.frame_bytes())
+                throw std::runtime_error("Output buffer is too small");
+            median.add_ser(path);
+            median.compute(percentile,out);
+        }
+        catch(std::exception const &e) {
+            snprintf(Stacker::error_message_,sizeof(Stacker::error_message_),"Failed: %s",e.what());
+            return -1;
+        }
+        return 0;
+    }
+
+    int stacker_set_rejection(Stacker *obj,float kappa)
+    {
+        try {
+            obj->set_rejection(kappa);
+        }
+        catch(std::exception const &e) {
+            snprintf(obj->error_message_,sizeof(obj->error_message_),"Failed: %s",e.what());
+            return -1;
+        }
+        return 0;
+    }
+
+    int stacker_set_tiles(Stacker *obj,int tile_size)
+    {
+        try {
+            obj->set_tiles(tile_size);
+        }
+        catch(std::exception const &e) {
+            snprintf(obj->error_message_,sizeof(obj->error_message_),"Failed: %s",e.what());
+            return -1;
+        }
+        return 0;
+    }
+
+    int stacker_set_selection(Stacker *obj,int keep)
+    {
+        try {
+            obj->set_selection(keep);
+        }
+        catch(std::exception const &e) {
+            snprintf(obj->error_message_,sizeof(obj->error_message_),"Failed: %s",e.what());
+            return -1;
+        }
+        return 0;
+    }
+
+    float stacker_score(Stacker *obj,int format,void const *data)
+    {
+        try {
+            return obj->score(format,data);
+        }
+        catch(std::exception const &e) {
+            snprintf(obj->error_message_,sizeof(obj->error_message_),"Failed: %s",e.what());
+            return -1;
+        }
+    }
+
+    int stacker_select(Stacker *obj,int format,void const *data,int restart)
+    {
+        try {
+            return obj->select(format,data,restart);
+        }
+        catch(std::exception const &e) {
+            snprintf(obj->error_message_,sizeof(obj->error_message_),"Failed: %s",e.what());
+            return -1;
+        }
+    }
+
+    int stacker_flush_selection(Stacker *obj)
+    {
+        try {
+            return obj->flush_selection();
+        }
+        catch(std::exception const &e) {
+            snprintf(obj->error_message_,sizeof(obj->error_message_),"Failed: %s",e.what());
+            return -1;
+        }
+    }
+
     void stacker_set_src_gamma(Stacker *obj,float gamma)
     {
         obj->set_source_gamma(gamma);
@@ -1,6 +1,8 @@
 #ifndef STACK_H
 #define STACK_H
 
+#include <stddef.h>
+
 #if __cplusplus
 extern "C" {
 #endif
@@ -8,16 +10,96 @@ extern "C" {
 typedef struct Stacker Stacker; 
 
 Stacker *stacker_new(int w,int h,int roi_x,int roi_y,int roi_size);
+// single channel stacker, all 8 bit images passed to/from it have 1 byte per pixel
+Stacker *stacker_new_mono(int w,int h,int roi_x,int roi_y,int roi_size);
 char const *stacker_error();
 void stacker_delete(Stacker *obj);
 int stacker_set_darks(Stacker *obj,unsigned char *rgb);
 int stacker_get_stacked(Stacker *obj,unsigned char *rgb);
 int stacker_stack_image(Stacker *obj,unsigned char *rgb,int restart); 
+// Y16 frame for mono stacker
+int stacker_stack_mono16(Stacker *obj,unsigned short *img,int restart);
+// raw YUYV frame as received from camera, converted and calibrated in a single pass
+int stacker_stack_yuyv(Stacker *obj,unsigned char *yuyv,int restart);
+// coarse to fine registration for large drift: 0 - off, 1 or 2 - estimate on ROI decimated
+// by 2 or 4 first. Must be called before the first frame
+int stacker_set_pyramid(Stacker *obj,int levels);
+// multi point alignment for seeing: local shifts of tiles of given size overlapping by half are
+// blended over the frame, 0 - off. Must be called before the first frame
+int stacker_set_tiles(Stacker *obj,int tile_size);
+// kappa-sigma rejection of outliers (satellites, cosmic rays, hot pixels) as frames are stacked,
+// typically 2.5-3, 0 - off. Must be called before the first frame
+int stacker_set_rejection(Stacker *obj,float kappa);
 void stacker_set_src_gamma(Stacker *obj,float gamma);
 // -1 as auto stretch
 void stacker_set_tgt_gamma(Stacker *obj,float gamma);
+// master file (see stacker_save_master) or raw float frame of older versions, used as the dark
 int stacker_load_darks(Stacker *obj,char const *path);
+// stacked image as half float dark master
 int stacker_save_stacked_darks(Stacker *obj,char const *path);
+// reallocations of stacker frame buffers, stays constant once the first frame is stacked. Other
+// heap allocations are not counted, the INCLUDE_MAIN test checks the whole process
+int stacker_get_allocations(Stacker *obj);
+
+// Pipelined stacking: frames are calibrated and registered on worker threads and added
+// to the stack in submission order. Frame formats for stacker_submit, RGB is 8 bit RGB
+// or mono as passed to stacker_stack_image, MONO16 as stacker_stack_mono16
+#define STACKER_FORMAT_RGB 0
+#define STACKER_FORMAT_MONO16 1
+#define STACKER_FORMAT_YUYV 2
+// result as returned by stacker_stack_image: 1 added, 0 registration failed, -1 error (see stacker_error).
+// Called from pipeline thread, the first frame from stacker_submit itself; must not call stacker functions
+typedef void (*stacker_callback_type)(void *user_data,int frame_id,int result);
+// threads <= 0 - number of cores - 1, queue_depth <= 0 - twice the threads, callback may be NULL
+int stacker_start_pipeline(Stacker *obj,int threads,int queue_depth,stacker_callback_type callback,void *user_data);
+// frame is copied, blocks while queue_depth frames are in progress. Returns frame id or -1.
+// May be called from several threads, ids follow the order frames are accepted
+int stacker_submit(Stacker *obj,int format,void const *data,int restart);
+// frames submitted and not completed yet
+int stacker_pending(Stacker *obj);
+// waits for all submitted frames, synchronous calls and settings changes do it implicitly
+void stacker_wait(Stacker *obj);
+void stacker_stop_pipeline(Stacker *obj);
+
+// Calibration masters, kinds match Calibration in calibration.h. Frames are calibrated as
+// (frame - bias - dark current * exposure) / normalized flat, with bias known darks are scaled
+// by exposure ratio, otherwise the dark is subtracted as is. Masters nearest to frame gain, then
+// exposure, are used. Masters are RGB or MONO16 frames or STACKER_FORMAT_FLOAT in [0,1]
+#define STACKER_MASTER_BIAS 0
+#define STACKER_MASTER_DARK 1
+#define STACKER_MASTER_FLAT 2
+#define STACKER_FORMAT_FLOAT 3
+// negative exposure or gain - unknown, matches any frame
+int stacker_add_master(Stacker *obj,int kind,int format,void const *data,float exposure_ms,float gain);
+int stacker_clear_masters(Stacker *obj);
+// exposure and gain of following frames, negative - unknown
+int stacker_set_frame_settings(Stacker *obj,float exposure_ms,float gain);
+// Master files: versioned header with geometry, exposure, gain, sensor temperature and frame count,
+// checksummed samples. Half float is precise enough for stacked masters at half the size of float
+#define STACKER_SAMPLE_FLOAT 0
+#define STACKER_SAMPLE_HALF 1
+#define STACKER_SAMPLE_UINT16 2
+// stacked image as master of given kind, exposure and gain of stacker_set_frame_settings are
+// recorded. temperature in C, NAN - unknown. Frames should be stacked without calibration
+int stacker_save_master(Stacker *obj,char const *path,int kind,int sample_type,float temperature);
+// adds master of the kind stored in the file, the file is mapped and validated
+int stacker_load_master(Stacker *obj,char const *path);
+
+// Lucky imaging, frames use STACKER_FORMAT_*. Sharpness of the frame over the registration ROI,
+// higher is sharper, -1 on error. For two passes over a recording score all frames first
+float stacker_score(Stacker *obj,int format,void const *data);
+// single pass: keep the sharpest frames in a buffer of given size, 0 disables
+int stacker_set_selection(Stacker *obj,int keep);
+// frame is copied if it is among the sharpest so far: returns 1 kept, 0 dropped, -1 error
+int stacker_select(Stacker *obj,int format,void const *data,int restart);
+// stacks kept frames in capture order and empties the buffer, through the pipeline if started.
+// Returns number of frames stacked or submitted
+int stacker_flush_selection(Stacker *obj);
+
+// per pixel percentile (50 - median) of all frames of SER recording, e.g. master dark. Frames are
+// streamed from the mapped file in bands so memory does not grow with frame count. out has the
+// layout of one frame of the file. Returns -1 on error, see stacker_error
+int stacker_median_ser(char const *path,float percentile,void *out,size_t out_size);
 
 #if __cplusplus
 }
@@ -0,0 +1,129 @@
+#pragma once
+#include "phase_correlation.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+//
+// Multi-point alignment for seeing distortions. The frame is covered by tiles overlapping
+// by half, each tile is phase correlated around the global shift and its local offset is
+// interpolated bilinearly between tile centres when the frame is accumulated. Tiles without
+// detail (sky around a planet) and implausible offsets keep the global shift.
+//
+// Reference spectra are read only once set, correlators hold plans and buffers so each
+// thread passes its own
+//
+class TileAligner {
+public:
+    // tiles with less contrast than this part of the most contrasted one are not aligned
+    static constexpr float min_contrast = 0.1f;
+    // small tiles need higher frequencies than the global ROI for sub pixel accuracy
+    static constexpr int low_pass = 8;
+
+    void init(cv::Size frame,int tile)
+    {
+        frame_ = frame;
+        tile_ = tile;
+        step_ = tile / 2;
+        cols_ = std::max(1,(frame.width - tile) / step_ + 1);
+        rows_ = std::max(1,(frame.height - tile) / step_ + 1);
+        // grid is centred, what does not fit is left at the borders
+        origin_ = cv::Point((frame.width - (cols_ - 1) * step_ - tile) / 2,(frame.height - (rows_ - 1) * step_ - tile) / 2);
+        reference_.assign(tiles(),cv::Mat());
+        active_.assign(tiles(),0);
+        make_table(frame.width,cols_,origin_.x,x_index_,x_frac_);
+        make_table(frame.height,rows_,origin_.y,y_index_,y_frac_);
+    }
+    int tiles() const
+    {
+        return rows_ * cols_;
+    }
+    int tile_size() const
+    {
+        return tile_;
+    }
+    // c is initialized with tile_size() and low_pass
+    void set_reference(cv::Mat const &frame,PhaseCorrelator &c)
+    {
+        std::vector<double> contrast(tiles());
+        int channel = frame.channels() == 1 ? 0 : 1;
+        double max_contrast = 0;
+        for(int t=0;t<tiles();t++) {
+            cv::Point p = position(t);
+            c.transform_reference(frame,p,reference_[t]);
+            cv::Scalar mean,dev;
+            cv::meanStdDev(cv::Mat(frame,cv::Rect(p.x,p.y,tile_,tile_)),mean,dev);
+            contrast[t] = dev[channel];
+            max_contrast = std::max(max_contrast,contrast[t]);
+        }
+        for(int t=0;t<tiles();t++)
+            active_[t] = max_contrast > 0 && contrast[t] >= min_contrast * max_contrast;
+    }
+    // offsets of tiles [first,last) relative to the global shift, zero for inactive tiles
+    void find_offsets(cv::Mat const &frame,cv::Point2f global,int first,int last,PhaseCorrelator &c,cv::Point2f *offsets) const
+    {
+        for(int t=first;t<last;t++) {
+            offsets[t] = cv::Point2f(0,0);
+            if(!active_[t])
+                continue;
+            // frame(x) matches reference(x + shift), see Registrator::find_shift
+            cv::Point p = position(t);
+            cv::Point q(p.x - cvRound(global.x),p.y - cvRound(global.y));
+            q.x = std::max(0,std::min(frame_.width - tile_,q.x));
+            q.y = std::max(0,std::min(frame_.height - tile_,q.y));
+            cv::Point2f r = c.find_shift(frame,q,reference_[t]);
+            cv::Point2f d(float(p.x - q.x) + r.x - global.x,float(p.y - q.y) + r.y - global.y);
+            float limit = tile_ / 4.0f;
+            if(std::abs(d.x) <= limit && std::abs(d.y) <= limit)
+                offsets[t] = d;
+        }
+    }
+    // offsets of all pixels of row y
+    void row_offsets(cv::Point2f const *offsets,int y,cv::Point2f *out) const
+    {
+        int j = y_index_[y];
+        float fy = y_frac_[y];
+        int j1 = std::min(j + 1,rows_ - 1);
+        cv::Point2f const *top = offsets + j * cols_;
+        cv::Point2f const *bottom = offsets + j1 * cols_;
+        for(int x=0;x<frame_.width;x++) {
+            int i = x_index_[x];
+            int i1 = std::min(i + 1,cols_ - 1);
+            float fx = x_frac_[x];
+            cv::Point2f a = top[i] * (1 - fx) + top[i1] * fx;
+            cv::Point2f b = bottom[i] * (1 - fx) + bottom[i1] * fx;
+            out[x] = a * (1 - fy) + b * fy;
+        }
+    }
+private:
+    cv::Point position(int t) const
+    {
+        return cv::Point(origin_.x + (t % cols_) * step_,origin_.y + (t / cols_) * step_);
+    }
+    // left node and weight of the right one for each pixel, clamped outside of tile centres
+    void make_table(int size,int nodes,int origin,std::vector<int> &index,std::vector<float> &frac)
+    {
+        index.resize(size);
+        frac.resize(size);
+        float first = origin + tile_ / 2.0f;
+        for(int x=0;x<size;x++) {
+            float t = std::max(0.0f,std::min(float(nodes - 1),(x - first) / step_));
+            int i = std::min(int(t),std::max(nodes - 2,0));
+            index[x] = i;
+            frac[x] = t - i;
+        }
+    }
+
+    cv::Size frame_;
+    int tile_ = 0;
+    int step_ = 0;
+    int rows_ = 0;
+    int cols_ = 0;
+    cv::Point origin_;
+    std::vector<cv::Mat> reference_;
+    std::vector<char> active_;
+    std::vector<int> x_index_;
+    std::vector<float> x_frac_;
+    std::vector<int> y_index_;
+    std::vector<float> y_frac_;
+};
@@ -1,4 +1,9 @@
 #include "uvc_control.h"
+#include "frame_pool.h"
+#include "yuv2rgb.h"
+#include "mjpeg_decoder.h"
+#include "ser_writer.h"
+#include "virtual_camera.h"
 #include "libusb-1.0/libusb.h"
 #include "libuvc/libuvc.h"
 #include <stdlib.h>
@@ -8,11 +13,37 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
-static int usb_option_set = 0;
 #define ERROR_SIZE 255
 #define MAX_FORMATS 128
-#define COMPRESSED_SIZE 2
+#define FORMATS_SIZE 5
+#define DEFAULT_POOL_SIZE 4
+#define DEFAULT_DECODER_THREADS 2
+#define DEFAULT_DECODER_DEPTH 3
+#define DEFAULT_RECORDER_QUEUE 16
+
+// automatic transfer buffers: transfers of up to 32 payloads, enough of them to hold
+// 40ms of stream data, doubled on each retune when too many frames arrive incomplete
+#define AUTO_PAYLOADS_PER_TRANSFER 32
+#define AUTO_IN_FLIGHT_MS 40
+#define AUTO_MIN_TRANSFERS 4
+#define AUTO_MAX_TRANSFERS 128
+#define AUTO_MAX_LEVEL 3
+#define AUTO_WINDOW_FRAMES 64
+#define AUTO_INCOMPLETE_PERCENT 5
+
+// controls applied by control worker, bit numbers of the pending mask
+#define CONTROL_AUTO 0
+#define CONTROL_EXPOSURE 1
+#define CONTROL_GAIN 2
+#define CONTROL_WB 3
+#define CONTROL_GAMMA 4
+#define CONTROLS_SIZE 5
+#define CONTROL_HISTORY 16
+#define EVENT_TIMEOUT_US 100000
 
 #define USE_YUV
 
@@ -21,17 +52,74 @@ typedef struct uvcctl_frame_format {
     int width,height,fps;
 } uvcctl_frame_format;
 
+// indexed by UVCCTL_FORMAT_*
+static enum uvc_frame_format const uvc_formats[FORMATS_SIZE] = {
+    UVC_FRAME_FORMAT_YUYV, UVC_FRAME_FORMAT_MJPEG, UVC_FRAME_FORMAT_GRAY8, UVC_FRAME_FORMAT_GRAY16, UVC_FRAME_FORMAT_RGB
+};
+static int const format_bytes_per_pixel[FORMATS_SIZE] = { 3, 3, 1, 2, 3 };
+static char const *format_names[FORMATS_SIZE] = { "YUYV", "MJPEG", "Y8", "Y16", "RGB" };
+
+// control values are -1 until set through uvcctl
+static uvcctl_controls const unknown_controls = { -1, -1.0f, -1.0f, -1, -1.0f, 0 };
+
+typedef struct control_snapshot {
+    int64_t time;
+    uvcctl_controls controls;
+} control_snapshot;
+
+//
+// libusb and UVC contexts shared by all open devices, with a single thread
+// handling USB events for all of them. Guarded by lock
+//
+typedef struct shared_context {
+    pthread_mutex_t lock;
+    int refs;
+    int option_set;
+    libusb_context *usb_ctx;
+    uvc_context_t *ctx;
+    pthread_t event_thread;
+    volatile int stop;
+    uvcctl *devices;
+} shared_context;
+
+static shared_context shared = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
 
 struct uvcctl {
     libusb_device_handle *usb_devh;
-    uvcctl_frame_format formats[COMPRESSED_SIZE][MAX_FORMATS];
+    uvcctl_frame_format formats[FORMATS_SIZE][MAX_FORMATS];
+    pthread_mutex_t limits_lock;
+    int limits_queried;
+    uvcctl_control_limits limits;
     uint16_t gain_min,gain_max;
-    int gain_queried;
-    int compressed;
+    pthread_mutex_t control_lock;
+    pthread_cond_t control_cond;
+    pthread_t control_thread;
+    int control_running,control_stop,control_busy;
+    int control_pending;
+    uvcctl_controls control_request;
+    uvcctl_controls control_applied;
+    control_snapshot control_history[CONTROL_HISTORY];
+    unsigned control_history_N;
+    char control_error[ERROR_SIZE+1];
+    int frame_period_us;
+    int format;
     int width;
     int height;
     int buf_count,buf_size;
-    int formats_N[COMPRESSED_SIZE];
+    int stream_buf_count,stream_buf_size;
+    int auto_buffers;
+    int buffer_level;
+    int window_frames,window_incomplete;
+    pthread_mutex_t stream_lock;
+    pthread_t retune_thread;
+    int retune_started,retune_done;
+    char const *stream_error;       // why running stream stopped delivering frames, NULL - it did not
+    int pool_size;
+    int latest_only;
+    int last_acquired_frame_no;
+    int decoder_threads,decoder_depth;
+    int formats_N[FORMATS_SIZE];
     uvc_device_handle_t *devh;
     uvc_context_t *ctx;
     int stream_format_no;
@@ -39,22 +127,66 @@ struct uvcctl {
     uvcctl_callback_type callback;
     uvc_stream_handle_t *strh;
     uvc_stream_ctrl_t ctrl;
+    frame_pool pool;
+    mjpeg_decoder decoder;
+    int spare_slot;
+    pthread_mutex_t recorder_lock;
+    ser_writer *recorder;
+    ser_writer_stats recorder_stats;
+    virtual_camera *virt;
+    int virt_deferred;              // raw or synthetic source, opened when the stream starts
+    uvcctl *next;
+    int shared_context;
+    double required_bps;
+    int64_t stream_start_us;
+    int last_frame_no;
+    int64_t clock_offset_us;
+    pthread_mutex_t stats_lock;
+    uvcctl_stats stats;
+    int64_t convert_us_total;
+    int convert_N;
     char error[ERROR_SIZE+1];
 };
 
 uvcctl *uvcctl_create()
 {
     uvcctl *p=(uvcctl *)calloc(1,sizeof(uvcctl));
-    if(p)
+    if(p) {
         uvcctl_set_size(p,640,480,0);
+        p->pool_size = DEFAULT_POOL_SIZE;
+        p->decoder_threads = DEFAULT_DECODER_THREADS;
+        p->decoder_depth = DEFAULT_DECODER_DEPTH;
+        pthread_mutex_init(&p->recorder_lock,NULL);
+        pthread_mutex_init(&p->stats_lock,NULL);
+        pthread_mutex_init(&p->stream_lock,NULL);
+        pthread_mutex_init(&p->limits_lock,NULL);
+        pthread_mutex_init(&p->control_lock,NULL);
+        pthread_cond_init(&p->control_cond,NULL);
+        p->control_request = unknown_controls;
+        p->control_applied = unknown_controls;
+    }
     return p;
 }
 
-void uvcctl_set_size(uvcctl *obj,int w,int h,int c)
+uvcctl *uvcctl_create_virtual(char const *source,int flags)
+{
+    uvcctl *p = uvcctl_create();
+    if(!p)
+        return NULL;
+    p->virt = (virtual_camera *)malloc(sizeof(virtual_camera));
+    if(!p->virt) {
+        uvcctl_delete(p);
+        return NULL;
+    }
+    virtual_camera_init(p->virt,source,flags);
+    return p;
+}
+
+void uvcctl_set_size(uvcctl *obj,int w,int h,int format)
 {
     obj->width = w;
     obj->height = h;
-    obj->compressed = c ? 1: 0;
+    obj->format = format;
 }
 
 void uvcctl_set_buffers(uvcctl *obj,int N,int size)
@@ -63,22 +195,205 @@ void uvcctl_set_buffers(uvcctl *obj,int N,int size)
     obj->buf_size = size;
 }
 
-int uvcctl_open(uvcctl *obj,int fd,int *sizes,int n)
+void uvcctl_get_buffers(uvcctl *obj,int *N,int *size)
+{
+    pthread_mutex_lock(&obj->stream_lock);
+    *N = obj->stream_buf_count;
+    *size = obj->stream_buf_size;
+    pthread_mutex_unlock(&obj->stream_lock);
+}
+
+void uvcctl_set_pool_size(uvcctl *obj,int N)
+{
+    obj->pool_size = N;
+}
+
+void uvcctl_set_latest_only(uvcctl *obj,int enable)
+{
+    obj->latest_only = enable;
+}
+
+void uvcctl_set_mjpeg_decoders(uvcctl *obj,int threads,int queue_depth)
+{
+    obj->decoder_threads = threads;
+    obj->decoder_depth = queue_depth;
+}
+
+static int format_type(const uvc_format_desc_t *desc)
+{
+    if(desc->bDescriptorSubtype == UVC_VS_FORMAT_MJPEG)
+        return UVCCTL_FORMAT_MJPEG;
+    if(desc->bDescriptorSubtype != UVC_VS_FORMAT_UNCOMPRESSED)
+        return -1;
+    if(memcmp(desc->fourccFormat,"YUY2",4) == 0)
+        return UVCCTL_FORMAT_YUYV;
+    // libuvc negotiates GRAY8 only by the Y800 GUID, other 8 bit mono fourccs would fail to start
+    if(memcmp(desc->fourccFormat,"Y800",4) == 0)
+        return UVCCTL_FORMAT_Y8;
+    if(memcmp(desc->fourccFormat,"Y16 ",4) == 0)
+        return UVCCTL_FORMAT_Y16;
+    return -1;
+}
+
+static void set_virtual_format(uvcctl *obj,int format,int width,int height,int fps)
+{
+    memset(obj->formats_N,0,sizeof(obj->formats_N));
+    if(format < 0 || format >= FORMATS_SIZE)
+        return;
+    uvcctl_frame_format *fmt = &obj->formats[format][0];
+    fmt->width = width;
+    fmt->height = height;
+    fmt->fps = fps;
+    obj->formats_N[format] = 1;
+}
+
+static int start_virtual(uvcctl *obj)
+{
+    virtual_camera *v = obj->virt;
+    if(virtual_camera_open(v,obj->width,obj->height,obj->format,obj->error,ERROR_SIZE) < 0)
+        return -1;
+    set_virtual_format(obj,v->format,v->width,v->height,v->fps);
+    printf("Virtual Format=%s %dx%d %d\n",format_names[v->format],v->width,v->height,v->fps);
+    return 0;
+}
+
+// SER recordings are opened right away and define the only size. Raw files and synthetic
+// source are opened by uvcctl_start_stream with the size set by then, until that the
+// current size is reported
+static int open_virtual(uvcctl *obj,int *sizes,int n)
+{
+    obj->virt_deferred = !virtual_camera_is_ser(obj->virt);
+    if(obj->virt_deferred) {
+        set_virtual_format(obj,obj->format,obj->width,obj->height,0);
+        return uvcctl_get_sizes(obj,obj->format,sizes,n);
+    }
+    if(start_virtual(obj) < 0)
+        return -1;
+    return uvcctl_get_sizes(obj,obj->virt->format,sizes,n);
+}
+
+static int64_t monotonic_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t realtime_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME,&ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void *event_thread(void *ptr)
+{
+    (void)ptr;
+    while(!shared.stop) {
+        struct timeval tv = { 0, EVENT_TIMEOUT_US };
+        libusb_handle_events_timeout_completed(shared.usb_ctx,&tv,NULL);
+    }
+    return NULL;
+}
+
+static int acquire_context(uvcctl *obj)
 {
-    if(!usb_option_set) {
+    int res = -1;
+    pthread_mutex_lock(&shared.lock);
+    if(obj->shared_context) {
+        res = 0;
+        goto exit_point;
+    }
+    if(!shared.option_set) {
         int r = libusb_set_option(NULL,LIBUSB_OPTION_NO_DEVICE_DISCOVERY, NULL);
         if(r < 0) {
             strncpy(obj->error,"Failed to set no discovery option",ERROR_SIZE);
-            return -1;
+            goto exit_point;
         }
-        usb_option_set=1;
+        shared.option_set = 1;
     }
-    int res = 0;
-    res = uvc_init(&obj->ctx,NULL);
-    if(res < 0) {
-        snprintf(obj->error,ERROR_SIZE,"Failed to init UVC Context %s",uvc_strerror(res));
-        return -1;
+    if(shared.refs == 0) {
+        int r = libusb_init(&shared.usb_ctx);
+        if(r < 0) {
+            snprintf(obj->error,ERROR_SIZE,"Failed to init libusb context %d",r);
+            goto exit_point;
+        }
+        // with external libusb context libuvc doesn't start its own event thread
+        r = uvc_init(&shared.ctx,shared.usb_ctx);
+        if(r < 0) {
+            snprintf(obj->error,ERROR_SIZE,"Failed to init UVC Context %s",uvc_strerror(r));
+            libusb_exit(shared.usb_ctx);
+            goto exit_point;
+        }
+        shared.stop = 0;
+        if(pthread_create(&shared.event_thread,NULL,event_thread,NULL) != 0) {
+            strncpy(obj->error,"Failed to start USB event thread",ERROR_SIZE);
+            uvc_exit(shared.ctx);
+            libusb_exit(shared.usb_ctx);
+            goto exit_point;
+        }
     }
+    shared.refs++;
+    obj->ctx = shared.ctx;
+    obj->shared_context = 1;
+    obj->next = shared.devices;
+    shared.devices = obj;
+    res = 0;
+exit_point:
+    pthread_mutex_unlock(&shared.lock);
+    return res;
+}
+
+static void release_context(uvcctl *obj)
+{
+    uvcctl **p;
+    pthread_mutex_lock(&shared.lock);
+    for(p = &shared.devices;*p;p = &(*p)->next) {
+        if(*p == obj) {
+            *p = obj->next;
+            break;
+        }
+    }
+    obj->ctx = NULL;
+    obj->shared_context = 0;
+    if(--shared.refs == 0) {
+        shared.stop = 1;
+        pthread_join(shared.event_thread,NULL);
+        uvc_exit(shared.ctx);
+        libusb_exit(shared.usb_ctx);
+        shared.ctx = NULL;
+        shared.usb_ctx = NULL;
+    }
+    pthread_mutex_unlock(&shared.lock);
+}
+
+void uvcctl_get_bandwidth(uvcctl_bandwidth *bw)
+{
+    uvcctl *p;
+    int64_t now = monotonic_us();
+    memset(bw,0,sizeof(*bw));
+    pthread_mutex_lock(&shared.lock);
+    for(p = shared.devices;p;p = p->next) {
+        bw->devices++;
+        pthread_mutex_lock(&p->stats_lock);
+        if(p->required_bps > 0) {
+            bw->streams++;
+            bw->required_mb_per_sec += p->required_bps * 1e-6;
+            if(now > p->stream_start_us)
+                bw->measured_mb_per_sec += p->stats.bytes_received / (double)(now - p->stream_start_us);
+        }
+        pthread_mutex_unlock(&p->stats_lock);
+    }
+    pthread_mutex_unlock(&shared.lock);
+}
+
+int uvcctl_open(uvcctl *obj,int fd,int *sizes,int n)
+{
+    if(obj->virt)
+        return open_virtual(obj,sizes,n);
+    if(acquire_context(obj) < 0)
+        return -1;
+    int res = 0;
     for(int tr=0;;tr++) {
         res = uvc_wrap(fd,obj->ctx,&obj->devh);
         if(res < 0 || obj->devh == NULL) {
@@ -96,101 +411,369 @@ int uvcctl_open(uvcctl *obj,int fd,int *sizes,int n)
     }
     const uvc_format_desc_t *format_desc = uvc_get_format_descs(obj->devh);
     for(;format_desc;format_desc=format_desc->next) {
-        if(format_desc->bDescriptorSubtype != UVC_VS_FORMAT_MJPEG && format_desc->bDescriptorSubtype != UVC_VS_FORMAT_UNCOMPRESSED)
+        int format = format_type(format_desc);
+        if(format < 0)
             continue;
-        int is_compressed = format_desc->bDescriptorSubtype == UVC_VS_FORMAT_MJPEG;
         const uvc_frame_desc_t *p = format_desc->frame_descs;
-        while(p && obj->formats_N[is_compressed] < MAX_FORMATS) {
-            uvcctl_frame_format *fmt = &obj->formats[is_compressed][obj->formats_N[is_compressed]];
+        while(p && obj->formats_N[format] < MAX_FORMATS) {
+            uvcctl_frame_format *fmt = &obj->formats[format][obj->formats_N[format]];
             fmt->width = p->wWidth;
             fmt->height = p->wHeight;
             fmt->fps = 10000000 / p->dwDefaultFrameInterval;
-            printf("Compressed=%d %dx%d %d\n",is_compressed,fmt->width,fmt->height,fmt->fps);
-            if(obj->formats_N[is_compressed] <= n && is_compressed) {
-                sizes[0] = fmt->width;
-                sizes[1] = fmt->height;
-                sizes += 2;
-            }
-            obj->formats_N[is_compressed] ++;
+            printf("Format=%s %dx%d %d\n",format_names[format],fmt->width,fmt->height,fmt->fps);
+            obj->formats_N[format] ++;
             p=p->next;
         }
     }
-    if(obj->formats_N[0] == 0 && obj->formats_N[1] == 0) {
-        strncpy(obj->error,"No YUV2 or MJPEG frame sizes found",ERROR_SIZE);
+    if(obj->formats_N[UVCCTL_FORMAT_YUYV] == 0 && obj->formats_N[UVCCTL_FORMAT_MJPEG] == 0
+       && obj->formats_N[UVCCTL_FORMAT_Y8] == 0 && obj->formats_N[UVCCTL_FORMAT_Y16] == 0)
+    {
+        strncpy(obj->error,"No YUV2, MJPEG, Y8 or Y16 frame sizes found",ERROR_SIZE);
+        return -1;
+    }
+    return uvcctl_get_sizes(obj,UVCCTL_FORMAT_MJPEG,sizes,n);
+}
+
+int uvcctl_get_sizes(uvcctl *obj,int format,int *sizes,int n)
+{
+    int i;
+    if(format < 0 || format >= FORMATS_SIZE) {
+        snprintf(obj->error,ERROR_SIZE,"Invalid format %d",format);
         return -1;
     }
-    return obj->formats_N[1] < n ? obj->formats_N[1] : n;
+    for(i=0;i<obj->formats_N[format] && i<n;i++) {
+        sizes[2*i] = obj->formats[format][i].width;
+        sizes[2*i+1] = obj->formats[format][i].height;
+    }
+    return i;
+}
+
+static int64_t capture_time_us(uvcctl *obj,uvc_frame_t const *frame)
+{
+    struct timespec const *ts = &frame->capture_time_finished;
+    if(ts->tv_sec == 0 && ts->tv_nsec == 0)
+        return realtime_us();
+    // libuvc stamps frames using CLOCK_MONOTONIC
+    return obj->clock_offset_us + (int64_t)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+static int hist_bin(int64_t us)
+{
+    int bin = 0;
+    while(us > 0 && bin < UVCCTL_HIST_BINS - 1) {
+        us >>= 1;
+        bin++;
+    }
+    return bin;
+}
+
+static void stats_count(uvcctl *obj,int *counter)
+{
+    pthread_mutex_lock(&obj->stats_lock);
+    (*counter)++;
+    pthread_mutex_unlock(&obj->stats_lock);
+}
+
+static void stats_convert(uvcctl *obj,int convert_us)
+{
+    pthread_mutex_lock(&obj->stats_lock);
+    obj->stats.convert_hist[hist_bin(convert_us)]++;
+    obj->convert_us_total += convert_us;
+    obj->convert_N++;
+    if(convert_us * 1e-3 > obj->stats.convert_ms_max)
+        obj->stats.convert_ms_max = convert_us * 1e-3;
+    pthread_mutex_unlock(&obj->stats_lock);
+}
+
+static void stats_latency(uvcctl *obj,int64_t timestamp)
+{
+    int bin = hist_bin(realtime_us() - timestamp);
+    pthread_mutex_lock(&obj->stats_lock);
+    obj->stats.latency_hist[bin]++;
+    pthread_mutex_unlock(&obj->stats_lock);
+}
+
+static void record_frame(uvcctl *obj,char const *data,int64_t timestamp)
+{
+    pthread_mutex_lock(&obj->recorder_lock);
+    if(obj->recorder)
+        ser_writer_push(obj->recorder,data,ser_time_from_unix_us(timestamp));
+    pthread_mutex_unlock(&obj->recorder_lock);
+}
+
+static void frame_controls(uvcctl *obj,int64_t timestamp,uvcctl_controls *controls);
+
+// called from one thread at a time in frame order
+static void deliver_frame(uvcctl *obj,int slot,frame_slot *info)
+{
+    if(info->error == NULL) {
+        frame_controls(obj,info->timestamp,&info->controls);
+        info->skipped = 0;
+        if(obj->last_frame_no >= 0 && info->frame_no > obj->last_frame_no)
+            info->skipped = info->frame_no - obj->last_frame_no - 1;
+        obj->last_frame_no = info->frame_no;
+        record_frame(obj,frame_pool_data(&obj->pool,slot),info->timestamp);
+        stats_count(obj,&obj->stats.frames_delivered);
+    }
+    if(obj->callback) {
+        if(info->error == NULL) {
+            obj->callback(obj->user_data,info->frame_no,frame_pool_data(&obj->pool,slot),
+                          info->width,info->height,info->bytes_per_pixel,info->timestamp,info->skipped,&info->controls,NULL);
+            stats_latency(obj,info->timestamp);
+        }
+        else {
+            obj->callback(obj->user_data,info->frame_no,NULL,-1,-1,-1,info->timestamp,0,NULL,info->error);
+        }
+        if(slot >= 0)
+            frame_pool_release(&obj->pool,slot);
+    }
+    else if(slot >= 0 && info->error && obj->latest_only) {
+        // don't replace pending complete frame with a failed one
+        frame_pool_recycle(&obj->pool,slot);
+    }
+    else if(slot >= 0) {
+        obj->pool.slots[slot] = *info;
+        frame_pool_put_ready(&obj->pool,slot);
+    }
+}
+
+static void mjpeg_callback(void *ptr,int slot,int frame_no,int width,int height,int64_t timestamp,int decode_us,char const *error_message)
+{
+    uvcctl *obj = (uvcctl *)(ptr);
+    frame_slot info = {
+        .frame_no = frame_no,
+        .width = width,
+        .height = height,
+        .bytes_per_pixel = 3,
+        .timestamp = timestamp,
+        .error = error_message,
+    };
+    if(error_message)
+        stats_count(obj,&obj->stats.frames_failed);
+    else
+        stats_convert(obj,decode_us);
+    deliver_frame(obj,slot,&info);
+}
+
+static void mjpeg_frame(uvcctl *obj,uvc_frame_t *frame)
+{
+    // all frames, including failed ones, go through decoder to keep order and single delivering thread
+    char const *error_message = NULL;
+    int slot = obj->spare_slot;
+    obj->spare_slot = -1;
+    if(slot < 0)
+        slot = frame_pool_get_free(&obj->pool);
+    if(slot < 0)
+        return;
+    if(frame->frame_format != UVC_COLOR_FORMAT_MJPEG)
+        error_message = "Got unexpected frame format";
+    int res = mjpeg_decoder_submit(&obj->decoder,frame->data,frame->data_bytes,frame->sequence,
+                                   frame->width,frame->height,capture_time_us(obj,frame),
+                                   slot,(unsigned char *)frame_pool_data(&obj->pool,slot),obj->pool.buffer_size,
+                                   error_message);
+    if(res < 0) {
+        // keep the buffer for next frame, only consumer side may return it to the pool
+        frame_pool_count_drop(&obj->pool);
+        obj->spare_slot = slot;
+    }
+}
+
+static void choose_buffers(uvcctl *obj)
+{
+    size_t payload = obj->ctrl.dwMaxPayloadTransferSize;
+    size_t frame_bytes = obj->ctrl.dwMaxVideoFrameSize;
+    int fps = obj->formats[obj->format][obj->stream_format_no].fps;
+    if(obj->ctrl.dwFrameInterval > 0)
+        fps = 10000000 / obj->ctrl.dwFrameInterval;
+    if(fps <= 0)
+        fps = 1;
+    if(frame_bytes == 0)
+        frame_bytes = (size_t)obj->width * obj->height * 2;
+    if(payload == 0)
+        payload = 3072;  // high bandwidth isochronous maximum
+    size_t size = payload * AUTO_PAYLOADS_PER_TRANSFER;
+    if(size > frame_bytes)
+        size = (frame_bytes + payload - 1) / payload * payload;
+    double in_flight = (double)frame_bytes * fps * AUTO_IN_FLIGHT_MS * (1 << obj->buffer_level) / 1000;
+    int count = (int)((in_flight + size - 1) / size);
+    if(count < AUTO_MIN_TRANSFERS)
+        count = AUTO_MIN_TRANSFERS;
+    if(count > AUTO_MAX_TRANSFERS)
+        count = AUTO_MAX_TRANSFERS;
+    obj->stream_buf_count = count;
+    obj->stream_buf_size = size;
+}
+
+static void my_callback(uvc_frame_t *frame, void *ptr);
+
+// stream is dead: callback gets a failed frame, acquire returns -1 instead of waiting forever
+static void stream_failed(uvcctl *obj,char const *message)
+{
+    obj->stream_error = message;
+    if(!obj->callback) {
+        frame_pool_stop(&obj->pool);
+        return;
+    }
+    frame_slot info = {
+        .frame_no = obj->last_frame_no + 1,
+        .timestamp = realtime_us(),
+        .error = message,
+    };
+    if(obj->format == UVCCTL_FORMAT_MJPEG) {
+        // delivered by the decoder after frames queued before, USB is stopped so the queue drains
+        while(mjpeg_decoder_submit(&obj->decoder,NULL,0,info.frame_no,0,0,info.timestamp,-1,NULL,0,message) < 0) {
+            struct timespec ts = { 0, 1000000 };
+            nanosleep(&ts,NULL);
+        }
+        return;
+    }
+    stats_count(obj,&obj->stats.frames_failed);
+    deliver_frame(obj,-1,&info);
+}
+
+static void virtual_end(void *ptr,char const *message)
+{
+    stream_failed((uvcctl *)ptr,message);
+}
+
+// restarts running stream with deeper transfer queue, USB callback can't do it as stopping joins its thread
+static void *retune_thread(void *ptr)
+{
+    uvcctl *obj = (uvcctl *)(ptr);
+    pthread_mutex_lock(&obj->stream_lock);
+    if(obj->strh) {
+        int prev_count = obj->stream_buf_count;
+        int prev_size = obj->stream_buf_size;
+        uvc_stream_stop(obj->strh);
+        obj->buffer_level++;
+        choose_buffers(obj);
+        uvc_stream_set_transfer_buffer_sizes(obj->strh,obj->stream_buf_count,obj->stream_buf_size);
+        int res = uvc_stream_start(obj->strh,my_callback,obj,0);
+        if(res < 0) {
+            printf("Failed to restart stream with %d transfers of %d bytes: %s\n",obj->stream_buf_count,obj->stream_buf_size,uvc_strerror(res));
+            // back to the transfers that worked so far, no further retunes
+            obj->buffer_level = AUTO_MAX_LEVEL;
+            obj->stream_buf_count = prev_count;
+            obj->stream_buf_size = prev_size;
+            uvc_stream_set_transfer_buffer_sizes(obj->strh,prev_count,prev_size);
+            res = uvc_stream_start(obj->strh,my_callback,obj,0);
+        }
+        if(res < 0)
+            stream_failed(obj,"Stream stopped, failed to restart it with new transfer buffers");
+        stats_count(obj,&obj->stats.transfer_retunes);
+    }
+    obj->retune_done = 1;
+    pthread_mutex_unlock(&obj->stream_lock);
+    return NULL;
+}
+
+static void join_retune(uvcctl *obj)
+{
+    if(obj->retune_started) {
+        pthread_join(obj->retune_thread,NULL);
+        obj->retune_started = 0;
+    }
+}
+
+static void track_incomplete(uvcctl *obj,int incomplete)
+{
+    if(!obj->auto_buffers)
+        return;
+    obj->window_frames++;
+    obj->window_incomplete += incomplete;
+    if(obj->window_frames < AUTO_WINDOW_FRAMES)
+        return;
+    int retune = obj->window_incomplete * 100 >= obj->window_frames * AUTO_INCOMPLETE_PERCENT;
+    obj->window_frames = 0;
+    obj->window_incomplete = 0;
+    // never block USB thread, if the lock is busy the stream is being stopped or retuned
+    if(!retune || obj->buffer_level >= AUTO_MAX_LEVEL || pthread_mutex_trylock(&obj->stream_lock) != 0)
+        return;
+    if(obj->retune_started && obj->retune_done)
+        join_retune(obj);
+    if(obj->strh && !obj->retune_started) {
+        obj->retune_done = 0;
+        obj->retune_started = pthread_create(&obj->retune_thread,NULL,retune_thread,obj) == 0;
+    }
+    pthread_mutex_unlock(&obj->stream_lock);
 }
 
 static void my_callback(uvc_frame_t *frame, void *ptr)
 {
     uvcctl *obj = (uvcctl *)(ptr);
-    uvc_frame_t *rgb = NULL;
-    int res;
+    int slot;
     char const *error_message = NULL;
-    rgb = uvc_allocate_frame(frame->width*frame->height*3);
-    if(!rgb) {
-        error_message = "Allocation failed";
+    int bpp = format_bytes_per_pixel[obj->format];
+    size_t pixels = (size_t)frame->width * frame->height;
+    pthread_mutex_lock(&obj->stats_lock);
+    obj->stats.frames_received++;
+    obj->stats.bytes_received += frame->data_bytes;
+    pthread_mutex_unlock(&obj->stats_lock);
+    if(obj->format == UVCCTL_FORMAT_MJPEG) {
+        // truncated JPEG is not detected here, libjpeg only warns about it
+        mjpeg_frame(obj,frame);
+        return;
+    }
+    slot = frame_pool_get_free(&obj->pool);
+    if(slot < 0) {
+        error_message = "No free frame buffers, frame dropped";
         goto exit_point;
     }
-    if(frame->frame_format != UVC_COLOR_FORMAT_YUYV) {
+    if(frame->frame_format != uvc_formats[obj->format]) {
         error_message = "Got unexpected frame format";
+        stats_count(obj,&obj->stats.frames_failed);
         goto exit_point;
     }
-    if(frame->data_bytes != frame->width * frame->height * 2) {
+    if(frame->data_bytes != pixels * (obj->format == UVCCTL_FORMAT_YUYV ? 2 : bpp)) {
         error_message = "Frame does not contain all the data";
+        stats_count(obj,&obj->stats.frames_incomplete);
+        track_incomplete(obj,1);
         goto exit_point;
     }
-
-    res = uvc_any2rgb(frame,rgb);
-    if(res < 0) {
-        error_message = "YUV2 to RGB conversion failed";
+    if(pixels * bpp > obj->pool.buffer_size) {
+        error_message = "Frame is larger than pool buffer";
+        stats_count(obj,&obj->stats.frames_failed);
         goto exit_point;
     }
 
+    int64_t start = monotonic_us();
+    if(obj->format == UVCCTL_FORMAT_YUYV)
+        yuyv2rgb((unsigned char const *)frame->data,(unsigned char *)frame_pool_data(&obj->pool,slot),pixels);
+    else
+        memcpy(frame_pool_data(&obj->pool,slot),frame->data,pixels * bpp);
+    stats_convert(obj,monotonic_us() - start);
+    track_incomplete(obj,0);
+
 exit_point:
-    if(obj->callback) {
-        if(error_message == NULL) {
-            obj->callback(obj->user_data,frame->sequence,rgb->data,rgb->width,rgb->height,3,NULL);
-        }
-        else {
-            obj->callback(obj->user_data,frame->sequence,NULL,-1,-1,-1,error_message);
-        }
-    }
-    if(rgb) {
-        uvc_free_frame(rgb);
+    {
+        frame_slot info = {
+            .frame_no = frame->sequence,
+            .width = frame->width,
+            .height = frame->height,
+            .bytes_per_pixel = bpp,
+            .timestamp = capture_time_us(obj,frame),
+            .error = error_message,
+        };
+        deliver_frame(obj,slot,&info);
     }
 }
 
-int uvcctl_start_stream(uvcctl *obj,uvcctl_callback_type callback,void *user_data)
+static int open_uvc_stream(uvcctl *obj)
 {
-    int i;
-    obj->stream_format_no = -1;
-    obj->user_data = user_data;
-    for(i=0;i<obj->formats_N[obj->compressed];i++) {
-        if(obj->formats[obj->compressed][i].height == obj->height && obj->formats[obj->compressed][i].width == obj->width) {
-            obj->stream_format_no = i;
-            break;
-        }
-    }
-    if(obj->stream_format_no == -1) {
-        snprintf(obj->error,ERROR_SIZE,"Unsupported format %dx%d",obj->width,obj->height);
-        return -1;
-    }
     int tries = 0;
     int res;
     while(tries < 5) {
         res = uvc_get_stream_ctrl_format_size(obj->devh,&obj->ctrl,
-                (!obj->compressed ? UVC_FRAME_FORMAT_YUYV : UVC_FRAME_FORMAT_MJPEG),
+                uvc_formats[obj->format],
                 obj->width,obj->height,
-                obj->formats[obj->compressed][obj->stream_format_no].fps);
+                obj->formats[obj->format][obj->stream_format_no].fps);
         if(res == 0)
             break;
         tries ++;
     }
     if(res < 0) {
-        snprintf(obj->error,ERROR_SIZE,"Failed to set stream size compressed=%d %dx%d fps=%d %s",
-                                obj->compressed,obj->width,obj->height,obj->formats[obj->compressed][obj->stream_format_no].fps,
+        snprintf(obj->error,ERROR_SIZE,"Failed to set stream size format=%s %dx%d fps=%d %s",
+                                format_names[obj->format],obj->width,obj->height,obj->formats[obj->format][obj->stream_format_no].fps,
                                 uvc_strerror(res));
         return -1;
     }
@@ -205,63 +788,212 @@ int uvcctl_start_stream(uvcctl *obj,uvcctl_callback_type callback,void *user_dat
         snprintf(obj->error,ERROR_SIZE,"Failed to set stream config %s",uvc_strerror(res));
         return -1;
     }
-    
-    uvc_stream_set_transfer_buffer_sizes(obj->strh,obj->buf_count,obj->buf_size);
+
+    obj->buffer_level = 0;
+    obj->window_frames = 0;
+    obj->window_incomplete = 0;
+    obj->auto_buffers = obj->buf_count <= 0 || obj->buf_size <= 0;
+    if(obj->auto_buffers) {
+        choose_buffers(obj);
+        printf("Transfer buffers %d x %d bytes, max payload %d\n",obj->stream_buf_count,obj->stream_buf_size,
+                (int)obj->ctrl.dwMaxPayloadTransferSize);
+    }
+    else {
+        obj->stream_buf_count = obj->buf_count;
+        obj->stream_buf_size = obj->buf_size;
+    }
+    uvc_stream_set_transfer_buffer_sizes(obj->strh,obj->stream_buf_count,obj->stream_buf_size);
+    return 0;
+}
+
+int uvcctl_start_stream(uvcctl *obj,uvcctl_callback_type callback,void *user_data)
+{
+    int i;
+    obj->stream_format_no = -1;
+    obj->user_data = user_data;
+    if(obj->format < 0 || obj->format >= FORMATS_SIZE) {
+        snprintf(obj->error,ERROR_SIZE,"Invalid format %d",obj->format);
+        return -1;
+    }
+    if(obj->virt && obj->virt_deferred && start_virtual(obj) < 0)
+        return -1;
+    for(i=0;i<obj->formats_N[obj->format];i++) {
+        if(obj->formats[obj->format][i].height == obj->height && obj->formats[obj->format][i].width == obj->width) {
+            obj->stream_format_no = i;
+            break;
+        }
+    }
+    if(obj->stream_format_no == -1) {
+        snprintf(obj->error,ERROR_SIZE,"Unsupported format %s %dx%d",format_names[obj->format],obj->width,obj->height);
+        return -1;
+    }
+    if(!obj->virt && open_uvc_stream(obj) < 0)
+        return -1;
+
+    frame_pool_free(&obj->pool);
+    // latest only mode needs at least one buffer each for consumer, pending frame and producer
+    int pool_size = obj->latest_only && obj->pool_size < 3 ? 3 : obj->pool_size;
+    if(frame_pool_init(&obj->pool,pool_size,(size_t)obj->width * obj->height * format_bytes_per_pixel[obj->format],obj->latest_only) < 0) {
+        snprintf(obj->error,ERROR_SIZE,"Failed to allocate pool of %d frames %dx%d",pool_size,obj->width,obj->height);
+        return -1;
+    }
+
+    mjpeg_decoder_free(&obj->decoder);
+    obj->spare_slot = -1;
+    if(obj->format == UVCCTL_FORMAT_MJPEG) {
+        size_t max_size = obj->ctrl.dwMaxVideoFrameSize;
+        if(max_size == 0)
+            max_size = (size_t)obj->width * obj->height * 2;
+        if(mjpeg_decoder_init(&obj->decoder,obj->decoder_threads,obj->decoder_depth,max_size,mjpeg_callback,obj) < 0) {
+            snprintf(obj->error,ERROR_SIZE,"Failed to create %d MJPEG decoders with queue %d",obj->decoder_threads,obj->decoder_depth);
+            frame_pool_free(&obj->pool);
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&obj->stats_lock);
+    memset(&obj->stats,0,sizeof(obj->stats));
+    obj->convert_us_total = 0;
+    obj->convert_N = 0;
+    obj->stream_start_us = monotonic_us();
+    pthread_mutex_unlock(&obj->stats_lock);
+    obj->last_frame_no = -1;
+    obj->last_acquired_frame_no = -1;
+    obj->stream_error = NULL;
+    obj->clock_offset_us = realtime_us() - monotonic_us();
+    obj->frame_period_us = 1000000 / (obj->formats[obj->format][obj->stream_format_no].fps > 0 ? obj->formats[obj->format][obj->stream_format_no].fps : 1);
 
     obj->callback = callback;
-    res = uvc_stream_start(obj->strh,callback ? my_callback : NULL,obj,0);
+    int res;
+    if(obj->virt) {
+        res = virtual_camera_start(obj->virt,my_callback,virtual_end,obj);
+        if(res < 0)
+            strncpy(obj->error,"Failed to start virtual camera",ERROR_SIZE);
+    }
+    else {
+        res = uvc_stream_start(obj->strh,my_callback,obj,0);
+        if(res < 0)
+            snprintf(obj->error,ERROR_SIZE,"Failed to start stream %s",uvc_strerror(res));
+    }
     if(res < 0) {
-        snprintf(obj->error,ERROR_SIZE,"Failed to start stream %s",uvc_strerror(res));
         obj->callback = NULL;
+        mjpeg_decoder_free(&obj->decoder);
+        frame_pool_free(&obj->pool);
         return -1;
     }
+    if(!obj->virt) {
+        size_t frame_bytes = obj->ctrl.dwMaxVideoFrameSize;
+        if(frame_bytes == 0)
+            frame_bytes = (size_t)obj->width * obj->height * 2;
+        pthread_mutex_lock(&obj->stats_lock);
+        obj->required_bps = (double)frame_bytes * 1000000 / obj->frame_period_us;
+        pthread_mutex_unlock(&obj->stats_lock);
+    }
     return 0;
 }
 
 
-int uvcctl_read_frame(uvcctl *obj,int timeout,int w,int h,char *buffer)
+int uvcctl_acquire_frame(uvcctl *obj,int timeout,uvcctl_frame *frame)
 {
-    uvc_frame_t *frame = NULL;
-    int res = uvc_stream_get_frame(obj->strh,&frame,timeout);
-    if(res == UVC_ERROR_TIMEOUT)
-        return 0;
-    if(res < 0) {
-        snprintf(obj->error,ERROR_SIZE,"Failed to get frame %s",uvc_strerror(res));
+    if(obj->pool.size == 0) {
+        strncpy(obj->error,"Stream is not open",ERROR_SIZE);
         return -1;
     }
-    if(w != (int)frame->width || h != (int)frame->height) {
-        snprintf(obj->error,ERROR_SIZE,"Frame #%d does not match requires w=%d h=%d frame %dx%d",
-                frame->sequence,
-                frame->width,frame->height,
-                w,h);
+    if(obj->callback) {
+        strncpy(obj->error,"Frames are delivered to callback",ERROR_SIZE);
         return -1;
     }
-    if(frame->frame_format == UVC_COLOR_FORMAT_YUYV && frame->data_bytes != (size_t)(frame->width*frame->height*2)) {
-        snprintf(obj->error,ERROR_SIZE,"Frame #%d does not give all uncompressed data - gived %ld, but needed %ld",
-                frame->sequence,
-                frame->data_bytes,(size_t)(frame->width*frame->height*2));
+    int slot = frame_pool_get_ready(&obj->pool,timeout);
+    if(slot == -2) {
+        strncpy(obj->error,obj->stream_error ? obj->stream_error : "Stream is stopped",ERROR_SIZE);
         return -1;
     }
-    uvc_frame_t frame_out;
-    memset(&frame_out,0,sizeof(frame_out));
-    frame_out.data = buffer;
-    frame_out.data_bytes = h*w*3;
-    res = uvc_any2rgb(frame,&frame_out);
-    if(res < 0) {
-        snprintf(obj->error,ERROR_SIZE,"Failed to convert frame %d to RGB %s, source %d,%d of %ld",
-            frame->sequence,
-            uvc_strerror(res),frame->width,frame->height,frame->data_bytes);
+    if(slot < 0)
+        return 0;
+    frame_slot *info = &obj->pool.slots[slot];
+    if(info->error) {
+        snprintf(obj->error,ERROR_SIZE,"Frame #%d: %s",info->frame_no,info->error);
+        frame_pool_release(&obj->pool,slot);
         return -1;
     }
+    frame->frame_no = info->frame_no;
+    frame->data = frame_pool_data(&obj->pool,slot);
+    frame->width = info->width;
+    frame->height = info->height;
+    frame->bytes_per_pixel = info->bytes_per_pixel;
+    frame->timestamp_us = info->timestamp;
+    frame->skipped = info->skipped;
+    if(obj->latest_only)
+        frame->skipped = obj->last_acquired_frame_no >= 0 && info->frame_no > obj->last_acquired_frame_no
+                         ? info->frame_no - obj->last_acquired_frame_no - 1 : 0;
+    obj->last_acquired_frame_no = info->frame_no;
+    frame->controls = info->controls;
+    frame->buffer_id = slot;
+    stats_latency(obj,info->timestamp);
+    return 1;
+}
+
+void uvcctl_release_frame(uvcctl *obj,uvcctl_frame const *frame)
+{
+    frame_pool_release(&obj->pool,frame->buffer_id);
+}
+
+int uvcctl_get_dropped_frames(uvcctl *obj)
+{
+    return atomic_load_explicit(&obj->pool.dropped,memory_order_relaxed);
+}
 
-    return frame->sequence;
+void uvcctl_get_stats(uvcctl *obj,uvcctl_stats *stats)
+{
+    pthread_mutex_lock(&obj->stats_lock);
+    *stats = obj->stats;
+    stats->convert_ms_avg = obj->convert_N > 0 ? obj->convert_us_total * 1e-3 / obj->convert_N : 0;
+    pthread_mutex_unlock(&obj->stats_lock);
+    stats->frames_dropped = uvcctl_get_dropped_frames(obj);
+}
+
+int uvcctl_read_frame(uvcctl *obj,int timeout,int w,int h,char *buffer,uvcctl_frame *info)
+{
+    uvcctl_frame frame;
+    int res = uvcctl_acquire_frame(obj,timeout,&frame);
+    if(res <= 0)
+        return res;
+    if(w != frame.width || h != frame.height) {
+        snprintf(obj->error,ERROR_SIZE,"Frame #%d does not match requires w=%d h=%d frame %dx%d",
+                frame.frame_no,
+                w,h,
+                frame.width,frame.height);
+        uvcctl_release_frame(obj,&frame);
+        return -1;
+    }
+    memcpy(buffer,frame.data,(size_t)w * h * frame.bytes_per_pixel);
+    uvcctl_release_frame(obj,&frame);
+    if(info) {
+        *info = frame;
+        info->data = NULL;
+    }
+    return frame.frame_no;
 }
 
 int uvcctl_stop_stream(uvcctl *obj)
 {
+    if(obj->virt && obj->virt->running) {
+        virtual_camera_stop(obj->virt);
+        mjpeg_decoder_free(&obj->decoder);
+        frame_pool_free(&obj->pool);
+        return 0;
+    }
     if(obj->strh) {
+        pthread_mutex_lock(&obj->stream_lock);
         int res = uvc_stream_stop(obj->strh);
         obj->strh = NULL;
+        pthread_mutex_unlock(&obj->stream_lock);
+        join_retune(obj);
+        pthread_mutex_lock(&obj->stats_lock);
+        obj->required_bps = 0;
+        pthread_mutex_unlock(&obj->stats_lock);
+        mjpeg_decoder_free(&obj->decoder);
+        frame_pool_free(&obj->pool);
         if(res < 0) {
             snprintf(obj->error,ERROR_SIZE,"Failed to stop stream %s",uvc_strerror(res));
             return -1;
@@ -272,12 +1004,101 @@ int uvcctl_stop_stream(uvcctl *obj)
     return -1;
 }
 
+int uvcctl_start_recording(uvcctl *obj,char const *path,int queue_frames)
+{
+    if(obj->recorder) {
+        strncpy(obj->error,"Recording is already running",ERROR_SIZE);
+        return -1;
+    }
+    if(obj->format < 0 || obj->format >= FORMATS_SIZE) {
+        snprintf(obj->error,ERROR_SIZE,"Invalid format %d",obj->format);
+        return -1;
+    }
+    ser_writer *w = (ser_writer *)calloc(1,sizeof(ser_writer));
+    if(!w) {
+        strncpy(obj->error,"Failed to allocate recorder",ERROR_SIZE);
+        return -1;
+    }
+    if(ser_writer_open(w,path,obj->width,obj->height,format_bytes_per_pixel[obj->format],
+                       queue_frames > 0 ? queue_frames : DEFAULT_RECORDER_QUEUE) < 0)
+    {
+        snprintf(obj->error,ERROR_SIZE,"Failed to open recording %s: %s",path,strerror(errno));
+        free(w);
+        return -1;
+    }
+    pthread_mutex_lock(&obj->recorder_lock);
+    obj->recorder = w;
+    pthread_mutex_unlock(&obj->recorder_lock);
+    return 0;
+}
+
+int uvcctl_stop_recording(uvcctl *obj)
+{
+    pthread_mutex_lock(&obj->recorder_lock);
+    ser_writer *w = obj->recorder;
+    obj->recorder = NULL;
+    if(w)
+        ser_writer_get_stats(w,&obj->recorder_stats);
+    pthread_mutex_unlock(&obj->recorder_lock);
+    if(!w) {
+        strncpy(obj->error,"Recording is not running",ERROR_SIZE);
+        return -1;
+    }
+    // flushes the queue outside of the lock so USB thread is not blocked
+    int res = ser_writer_close(w);
+    obj->recorder_stats.failed = obj->recorder_stats.failed || res < 0;
+    free(w);
+    if(res < 0) {
+        snprintf(obj->error,ERROR_SIZE,"Failed to write recording: %s",strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void uvcctl_get_recorder_stats(uvcctl *obj,uvcctl_recorder_stats *stats)
+{
+    ser_writer_stats s;
+    pthread_mutex_lock(&obj->recorder_lock);
+    if(obj->recorder)
+        ser_writer_get_stats(obj->recorder,&s);
+    else
+        s = obj->recorder_stats;
+    pthread_mutex_unlock(&obj->recorder_lock);
+    stats->frames_written = s.frames_written;
+    stats->frames_dropped = s.frames_dropped;
+    stats->queue_size = s.queue_size;
+    stats->queue_high_water = s.queue_high_water;
+    stats->write_stalls = s.write_stalls;
+    stats->failed = s.failed;
+}
+
+static void stop_controls(uvcctl *obj);
+
 void uvcctl_delete(uvcctl *obj)
 {
+    if(obj->strh || (obj->virt && obj->virt->running))
+        uvcctl_stop_stream(obj);
+    stop_controls(obj);
+    if(obj->recorder)
+        uvcctl_stop_recording(obj);
+    if(obj->virt) {
+        virtual_camera_close(obj->virt);
+        free(obj->virt);
+        obj->virt = NULL;
+    }
+    mjpeg_decoder_free(&obj->decoder);
+    frame_pool_free(&obj->pool);
     if(obj->devh)
         uvc_close(obj->devh);
-    if(obj->ctx)
-        uvc_exit(obj->ctx);
+    if(obj->shared_context)
+        release_context(obj);
+    pthread_mutex_destroy(&obj->recorder_lock);
+    pthread_mutex_destroy(&obj->stats_lock);
+    pthread_mutex_destroy(&obj->stream_lock);
+    pthread_mutex_destroy(&obj->limits_lock);
+    pthread_mutex_destroy(&obj->control_lock);
+    pthread_cond_destroy(&obj->control_cond);
+    free(obj);
 }
 
 char const *uvcctl_error(uvcctl *obj)
@@ -295,20 +1116,20 @@ void uvcctl_close_fd(int fd)
 }
 
 
-int uvcctl_auto_mode(uvcctl *obj,int is_auto)
+static int apply_auto_mode(uvcctl *obj,int is_auto,char *error)
 {
     int res,res2;
     if(is_auto) {
         res = uvc_set_white_balance_temperature_auto(obj->devh,1);
         if(res < 0) {
-            snprintf(obj->error,ERROR_SIZE,"WB auto on failed:%s",uvc_strerror(res));
+            snprintf(error,ERROR_SIZE,"WB auto on failed:%s",uvc_strerror(res));
             return -1;
         }
         res = uvc_set_ae_mode(obj->devh,2);
         if(res < 0) {
             res2 = uvc_set_ae_mode(obj->devh,8);
             if(res2 < 0) {
-                snprintf(obj->error,ERROR_SIZE,"Failed to set AE mode 2 %s and mode 8 %s",uvc_strerror(res),uvc_strerror(res2));
+                snprintf(error,ERROR_SIZE,"Failed to set AE mode 2 %s and mode 8 %s",uvc_strerror(res),uvc_strerror(res2));
                 return -1;
             }
         }
@@ -316,7 +1137,7 @@ int uvcctl_auto_mode(uvcctl *obj,int is_auto)
     else {
         res = uvc_set_white_balance_temperature_auto(obj->devh,0);
         if(res < 0) {
-            snprintf(obj->error,ERROR_SIZE,"WB auto off failed:%s",uvc_strerror(res));
+            snprintf(error,ERROR_SIZE,"WB auto off failed:%s",uvc_strerror(res));
             return -1;
         }
         res = uvc_set_ae_mode(obj->devh,0);
@@ -325,7 +1146,7 @@ int uvcctl_auto_mode(uvcctl *obj,int is_auto)
             if(res < 0) {
                 res = uvc_set_ae_mode(obj->devh,1);
                 if(res < 0) {
-                    snprintf(obj->error,ERROR_SIZE,"AE off failed:%s",uvc_strerror(res));
+                    snprintf(error,ERROR_SIZE,"AE off failed:%s",uvc_strerror(res));
                     return -1;
                 }
             }
@@ -334,69 +1155,37 @@ int uvcctl_auto_mode(uvcctl *obj,int is_auto)
     return 0;
 }
 
-static int query_gain(uvcctl *obj)
+static int read_limits(uvcctl *obj,char *error)
 {
-    uint16_t min_g=0,max_g=0;
-    int res;
-    if(obj->gain_queried)
+    uvcctl_control_limits *limits = &obj->limits;
+    if(obj->virt) {
+        // typical webcam ranges, recorded frames are already gamma encoded by the camera
+        limits->exp_msec_min = 0.1f;
+        limits->exp_msec_max = 1000.0f;
+        limits->wb_temp_min = 2800;
+        limits->wb_temp_max = 6500;
+        limits->gamma_min = 1.0f;
+        limits->gamma_cur = 1.0f;
+        limits->gamma_max = 5.0f;
+        obj->gain_min = 0;
+        obj->gain_max = 100;
         return 0;
+    }
+    int res;
+    uint16_t min_g=0,max_g=0;
     if((res=uvc_get_gain(obj->devh,&max_g,UVC_GET_MAX)) < 0) {
-        snprintf(obj->error,ERROR_SIZE,"Failed to get gain max %s",uvc_strerror(res));
+        snprintf(error,ERROR_SIZE,"Failed to get gain max %s",uvc_strerror(res));
         return -1;
     }
     if((res=uvc_get_gain(obj->devh,&min_g,UVC_GET_MIN)) < 0) {
-        snprintf(obj->error,ERROR_SIZE,"Failed to get gain min %s",uvc_strerror(res));
-        return -1;
-    }
-    obj->gain_queried=1;
-    obj->gain_min = min_g;
-    obj->gain_max = max_g;
-    return 0;
-}
-
-int uvcctl_set_wb(uvcctl *obj,int temperature)
-{
-    int res = uvc_set_white_balance_temperature(obj->devh,temperature);
-    if(res < 0) {
-        snprintf(obj->error,ERROR_SIZE,"Failed to set WB Temperature %s",uvc_strerror(res));
-        return -1;
-    }
-    return 0;
-}
-
-int uvcctl_set_gain(uvcctl *obj,double gain)
-{
-    if(query_gain(obj)<0)
-        return -1;
-    int gain_value = obj->gain_min * (1 - gain) + obj->gain_max * gain;
-    int res = uvc_set_gain(obj->devh,gain_value);
-    if(res < 0) {
-        snprintf(obj->error,ERROR_SIZE,"Failed to set gain %s",uvc_strerror(res));
-        return -1;
-    }
-    return 0;
-}
-
-int uvcctl_set_exposure(uvcctl *obj,double exp_ms)
-{
-    int res = uvc_set_exposure_abs(obj->devh,exp_ms * 10);
-    if(res < 0) {
-        snprintf(obj->error,ERROR_SIZE,"Failed to set exposure %s",uvc_strerror(res));
+        snprintf(error,ERROR_SIZE,"Failed to get gain min %s",uvc_strerror(res));
         return -1;
     }
-    return 0;
-}
-
-int uvcctl_get_control_limits(uvcctl *obj,uvcctl_control_limits *limits)
-{
-    if(query_gain(obj) < 0)
-        return -1;
-    int res;
     uint32_t min_time=0,max_time=0;
     if((res = uvc_get_exposure_abs(obj->devh,&min_time,UVC_GET_MIN)) < 0 ||
         (res = uvc_get_exposure_abs(obj->devh,&max_time,UVC_GET_MAX)) < 0)
     {
-        snprintf(obj->error,ERROR_SIZE,"Failed to get exposure range %s",uvc_strerror(res));
+        snprintf(error,ERROR_SIZE,"Failed to get exposure range %s",uvc_strerror(res));
         return -1;
     }
     uint16_t min_gamma=0,max_gamma=0,cur_gamma=0;
@@ -404,16 +1193,18 @@ int uvcctl_get_control_limits(uvcctl *obj,uvcctl_control_limits *limits)
         (res = uvc_get_gamma(obj->devh,&cur_gamma,UVC_GET_CUR)) < 0 || 
         (res = uvc_get_gamma(obj->devh,&max_gamma,UVC_GET_MAX)) < 0)
     {
-        snprintf(obj->error,ERROR_SIZE,"Failed to get gamma range %s",uvc_strerror(res));
+        snprintf(error,ERROR_SIZE,"Failed to get gamma range %s",uvc_strerror(res));
         return -1;
     }
     uint16_t min_wb=0,max_wb=0;
     if((res=uvc_get_white_balance_temperature(obj->devh,&min_wb,UVC_GET_MIN)) < 0
         || (res=uvc_get_white_balance_temperature(obj->devh,&max_wb,UVC_GET_MAX)) < 0)
     {
-        snprintf(obj->error,ERROR_SIZE,"Failed to get WB range %s",uvc_strerror(res));
+        snprintf(error,ERROR_SIZE,"Failed to get WB range %s",uvc_strerror(res));
         return -1;
     }
+    obj->gain_min = min_g;
+    obj->gain_max = max_g;
     limits->exp_msec_min = min_time * 0.1f;
     limits->exp_msec_max = max_time * 0.1f;
     limits->wb_temp_min = min_wb;
@@ -423,14 +1214,394 @@ int uvcctl_get_control_limits(uvcctl *obj,uvcctl_control_limits *limits)
     limits->gamma_max = max_gamma / 100.0f;
     return 0;
 }
-int uvcctl_set_gamma(uvcctl *obj,double value)
+
+// limits are read from the device once and cached
+static int query_limits(uvcctl *obj,char *error)
 {
-    int res = uvc_set_gamma(obj->devh,(int)(value * 100));
-    if(res < 0) {
-        snprintf(obj->error,ERROR_SIZE,"Failed to set gamma %s",uvc_strerror(res));
+    int res = 0;
+    pthread_mutex_lock(&obj->limits_lock);
+    if(!obj->limits_queried) {
+        res = read_limits(obj,error);
+        obj->limits_queried = res == 0;
+    }
+    pthread_mutex_unlock(&obj->limits_lock);
+    return res;
+}
+
+static int apply_control(uvcctl *obj,int control,uvcctl_controls const *c,char *error)
+{
+    int res = 0;
+    if(obj->virt)
+        return 0;
+    switch(control) {
+    case CONTROL_AUTO:
+        return apply_auto_mode(obj,c->auto_mode,error);
+    case CONTROL_EXPOSURE:
+        res = uvc_set_exposure_abs(obj->devh,c->exposure_ms * 10);
+        if(res < 0)
+            snprintf(error,ERROR_SIZE,"Failed to set exposure %s",uvc_strerror(res));
+        break;
+    case CONTROL_GAIN:
+        if(query_limits(obj,error) < 0)
+            return -1;
+        res = uvc_set_gain(obj->devh,obj->gain_min * (1 - c->gain) + obj->gain_max * c->gain);
+        if(res < 0)
+            snprintf(error,ERROR_SIZE,"Failed to set gain %s",uvc_strerror(res));
+        break;
+    case CONTROL_WB:
+        res = uvc_set_white_balance_temperature(obj->devh,c->wb_temperature);
+        if(res < 0)
+            snprintf(error,ERROR_SIZE,"Failed to set WB Temperature %s",uvc_strerror(res));
+        break;
+    case CONTROL_GAMMA:
+        res = uvc_set_gamma(obj->devh,(int)(c->gamma * 100));
+        if(res < 0)
+            snprintf(error,ERROR_SIZE,"Failed to set gamma %s",uvc_strerror(res));
+        break;
+    }
+    return res < 0 ? -1 : 0;
+}
+
+// called with control_lock held
+static void push_controls(uvcctl *obj)
+{
+    control_snapshot *s = &obj->control_history[obj->control_history_N++ % CONTROL_HISTORY];
+    s->time = realtime_us();
+    s->controls = obj->control_applied;
+}
+
+//
+// Applies only the latest requested value of each control, so fast slider
+// movements don't queue up USB control transfers
+//
+static void *control_worker(void *ptr)
+{
+    uvcctl *obj = (uvcctl *)(ptr);
+    char error[ERROR_SIZE+1];
+    pthread_mutex_lock(&obj->control_lock);
+    for(;;) {
+        while(!obj->control_pending && !obj->control_stop)
+            pthread_cond_wait(&obj->control_cond,&obj->control_lock);
+        if(!obj->control_pending)
+            break;
+        int pending = obj->control_pending;
+        uvcctl_controls request = obj->control_request;
+        obj->control_pending = 0;
+        obj->control_busy = 1;
+        pthread_mutex_unlock(&obj->control_lock);
+
+        int control,applied = 0;
+        error[0] = 0;
+        for(control=0;control<CONTROLS_SIZE;control++) {
+            if((pending & (1 << control)) && apply_control(obj,control,&request,error) == 0)
+                applied |= 1 << control;
+        }
+        if(applied & (1 << CONTROL_GAMMA)) {
+            pthread_mutex_lock(&obj->limits_lock);
+            obj->limits.gamma_cur = request.gamma;
+            pthread_mutex_unlock(&obj->limits_lock);
+        }
+
+        pthread_mutex_lock(&obj->control_lock);
+        uvcctl_controls *c = &obj->control_applied;
+        if(applied & (1 << CONTROL_AUTO))
+            c->auto_mode = request.auto_mode;
+        if(applied & (1 << CONTROL_EXPOSURE))
+            c->exposure_ms = request.exposure_ms;
+        if(applied & (1 << CONTROL_GAIN))
+            c->gain = request.gain;
+        if(applied & (1 << CONTROL_WB))
+            c->wb_temperature = request.wb_temperature;
+        if(applied & (1 << CONTROL_GAMMA))
+            c->gamma = request.gamma;
+        if(applied) {
+            c->generation++;
+            push_controls(obj);
+        }
+        if(error[0])
+            memcpy(obj->control_error,error,sizeof(error));
+        obj->control_busy = 0;
+        pthread_cond_broadcast(&obj->control_cond);
+    }
+    pthread_mutex_unlock(&obj->control_lock);
+    return NULL;
+}
+
+// failures of previously queued values are reported by the next call
+static int queue_control(uvcctl *obj,int control,double value)
+{
+    pthread_mutex_lock(&obj->control_lock);
+    if(obj->control_error[0]) {
+        memcpy(obj->error,obj->control_error,sizeof(obj->error));
+        obj->control_error[0] = 0;
+        pthread_mutex_unlock(&obj->control_lock);
         return -1;
     }
+    if(!obj->control_running) {
+        if(pthread_create(&obj->control_thread,NULL,control_worker,obj) != 0) {
+            pthread_mutex_unlock(&obj->control_lock);
+            strncpy(obj->error,"Failed to start control thread",ERROR_SIZE);
+            return -1;
+        }
+        obj->control_running = 1;
+    }
+    uvcctl_controls *c = &obj->control_request;
+    switch(control) {
+    case CONTROL_AUTO: c->auto_mode = value != 0; break;
+    case CONTROL_EXPOSURE: c->exposure_ms = value; break;
+    case CONTROL_GAIN: c->gain = value; break;
+    case CONTROL_WB: c->wb_temperature = value; break;
+    case CONTROL_GAMMA: c->gamma = value; break;
+    }
+    obj->control_pending |= 1 << control;
+    pthread_cond_broadcast(&obj->control_cond);
+    pthread_mutex_unlock(&obj->control_lock);
+    return 0;
+}
+
+static void stop_controls(uvcctl *obj)
+{
+    pthread_mutex_lock(&obj->control_lock);
+    int running = obj->control_running;
+    obj->control_stop = 1;
+    pthread_cond_broadcast(&obj->control_cond);
+    pthread_mutex_unlock(&obj->control_lock);
+    if(running)
+        pthread_join(obj->control_thread,NULL);
+    obj->control_running = 0;
+}
+
+int uvcctl_flush_controls(uvcctl *obj)
+{
+    pthread_mutex_lock(&obj->control_lock);
+    while(obj->control_running && (obj->control_pending || obj->control_busy))
+        pthread_cond_wait(&obj->control_cond,&obj->control_lock);
+    int res = 0;
+    if(obj->control_error[0]) {
+        memcpy(obj->error,obj->control_error,sizeof(obj->error));
+        obj->control_error[0] = 0;
+        res = -1;
+    }
+    pthread_mutex_unlock(&obj->control_lock);
+    return res;
+}
+
+void uvcctl_get_controls(uvcctl *obj,uvcctl_controls *controls)
+{
+    pthread_mutex_lock(&obj->control_lock);
+    *controls = obj->control_applied;
+    pthread_mutex_unlock(&obj->control_lock);
+}
+
+// values applied before the exposure of the frame started, frame timestamp marks its end
+static void frame_controls(uvcctl *obj,int64_t timestamp,uvcctl_controls *controls)
+{
+    int64_t start = timestamp - obj->frame_period_us;
+    pthread_mutex_lock(&obj->control_lock);
+    unsigned n = obj->control_history_N;
+    unsigned first = n > CONTROL_HISTORY ? n - CONTROL_HISTORY : 0;
+    *controls = first == 0 ? unknown_controls : obj->control_history[first % CONTROL_HISTORY].controls;
+    while(n > first) {
+        n--;
+        if(obj->control_history[n % CONTROL_HISTORY].time <= start) {
+            *controls = obj->control_history[n % CONTROL_HISTORY].controls;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&obj->control_lock);
+}
+
+int uvcctl_auto_mode(uvcctl *obj,int is_auto)
+{
+    return queue_control(obj,CONTROL_AUTO,is_auto);
+}
+
+int uvcctl_set_wb(uvcctl *obj,int temperature)
+{
+    return queue_control(obj,CONTROL_WB,temperature);
+}
+
+int uvcctl_set_gain(uvcctl *obj,double gain)
+{
+    return queue_control(obj,CONTROL_GAIN,gain);
+}
+
+int uvcctl_set_exposure(uvcctl *obj,double exp_ms)
+{
+    return queue_control(obj,CONTROL_EXPOSURE,exp_ms);
+}
+
+int uvcctl_get_control_limits(uvcctl *obj,uvcctl_control_limits *limits)
+{
+    if(query_limits(obj,obj->error) < 0)
+        return -1;
+    pthread_mutex_lock(&obj->limits_lock);
+    *limits = obj->limits;
+    pthread_mutex_unlock(&obj->limits_lock);
     return 0;
 }
 
+int uvcctl_set_gamma(uvcctl *obj,double value)
+{
+    return queue_control(obj,CONTROL_GAMMA,value);
+}
+
+
+
+#ifdef INCLUDE_MAIN
+//
+// Capture path benchmark, no camera needed: synthetic frames from the virtual camera go
+// through my_callback, conversion/decoding and delivery as fast as they can be produced.
+// Prints JSON to stdout, library messages go to stderr. Linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc
+// it also counts allocations made by the library code per frame
+//
+#define BENCH_WARMUP_US 200000
+
+static atomic_long bench_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n,size_t size);
+void *__real_realloc(void *p,size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    atomic_fetch_add_explicit(&bench_allocs,1,memory_order_relaxed);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n,size_t size)
+{
+    atomic_fetch_add_explicit(&bench_allocs,1,memory_order_relaxed);
+    return __real_calloc(n,size);
+}
+
+void *__wrap_realloc(void *p,size_t size)
+{
+    atomic_fetch_add_explicit(&bench_allocs,1,memory_order_relaxed);
+    return __real_realloc(p,size);
+}
+
+typedef struct bench_counters {
+    atomic_int frames;
+    atomic_int errors;
+} bench_counters;
+
+static void bench_callback(void *user_data,int frame_no,char const *data,int w,int h,int bpp,
+                           int64_t timestamp_us,int skipped,uvcctl_controls const *controls,char const *error_message)
+{
+    bench_counters *c = (bench_counters *)user_data;
+    (void)frame_no; (void)data; (void)w; (void)h; (void)bpp; (void)timestamp_us; (void)skipped; (void)controls;
+    atomic_fetch_add_explicit(error_message ? &c->errors : &c->frames,1,memory_order_relaxed);
+}
+
+// reads frames until deadline, returns number of frames read or -1
+static int bench_read(uvcctl *obj,int64_t deadline,int w,int h,char *buffer,int *errors)
+{
+    int frames = 0;
+    while(monotonic_us() < deadline) {
+        int res = uvcctl_read_frame(obj,100000,w,h,buffer,NULL);
+        if(res > 0)
+            frames++;
+        else if(res < 0)
+            (*errors)++;
+    }
+    return frames;
+}
 
+static int bench_run(FILE *out,int format,int w,int h,int use_callback,int64_t duration_us,int first)
+{
+    bench_counters counters;
+    char *buffer = NULL;
+    int sizes[2];
+    int frames = 0,errors = 0;
+    uvcctl *obj = uvcctl_create_virtual("synthetic",UVCCTL_VIRTUAL_BENCHMARK);
+    if(!obj)
+        return -1;
+    atomic_init(&counters.frames,0);
+    atomic_init(&counters.errors,0);
+    uvcctl_set_size(obj,w,h,format);
+    if(uvcctl_open(obj,-1,sizes,1) < 0 || (!use_callback && !(buffer = (char *)malloc((size_t)w * h * format_bytes_per_pixel[format])))
+       || uvcctl_start_stream(obj,use_callback ? bench_callback : NULL,&counters) < 0)
+    {
+        fprintf(stderr,"%s %dx%d: %s\n",format_names[format],w,h,obj->error);
+        free(buffer);
+        uvcctl_delete(obj);
+        return -1;
+    }
+
+    // pool, decoder and thread start up are not part of the measurement
+    int64_t start = monotonic_us() + BENCH_WARMUP_US;
+    if(use_callback)
+        usleep(BENCH_WARMUP_US);
+    else
+        bench_read(obj,start,w,h,buffer,&errors);
+    uvcctl_stats before,after;
+    uvcctl_get_stats(obj,&before);
+    long allocs = atomic_load(&bench_allocs);
+    // counters keep running through warm up, only the measured window is reported
+    int frames_before = atomic_load(&counters.frames);
+    int errors_before = atomic_load(&counters.errors);
+    errors = 0;
+    start = monotonic_us();
+    if(use_callback) {
+        usleep(duration_us);
+        frames = atomic_load(&counters.frames) - frames_before;
+        errors = atomic_load(&counters.errors) - errors_before;
+    }
+    else {
+        frames = bench_read(obj,start + duration_us,w,h,buffer,&errors);
+    }
+    double passed = (monotonic_us() - start) * 1e-6;
+    allocs = atomic_load(&bench_allocs) - allocs;
+    uvcctl_get_stats(obj,&after);
+    uvcctl_stop_stream(obj);
+    uvcctl_delete(obj);
+    free(buffer);
+
+    fprintf(out,"%s    {\"format\":\"%s\",\"width\":%d,\"height\":%d,\"mode\":\"%s\",\"frames\":%d,"
+           "\"fps\":%.1f,\"ns_per_pixel\":%.3f,\"allocs_per_frame\":%.3f,"
+           "\"received\":%d,\"dropped\":%d,\"errors\":%d,\"convert_ms_avg\":%.3f}",
+           first ? "" : ",\n",
+           format_names[format],w,h,use_callback ? "callback" : "read",frames,
+           frames / passed,
+           frames > 0 ? passed * 1e9 / ((double)frames * w * h) : 0.0,
+           frames > 0 ? (double)allocs / frames : 0.0,
+           after.frames_received - before.frames_received,
+           after.frames_dropped - before.frames_dropped,
+           errors,
+           after.convert_ms_avg);
+    return 0;
+}
+
+int main(int argc,char **argv)
+{
+    static int const formats[] = { UVCCTL_FORMAT_YUYV, UVCCTL_FORMAT_MJPEG, UVCCTL_FORMAT_Y16 };
+    static int const sizes[][2] = { { 640, 480 }, { 1280, 720 }, { 1920, 1080 } };
+    double seconds = argc >= 2 ? atof(argv[1]) : 1.0;
+    char const *impl = NULL;
+    int first = 1;
+    int status = 0;
+    size_t f,s;
+    int mode;
+    // keep JSON clean of the messages library prints
+    FILE *out = fdopen(dup(1),"w");
+    if(!out)
+        return 1;
+    dup2(2,1);
+    yuyv2rgb_select(&impl);
+    fprintf(out,"{\n  \"yuyv2rgb\":\"%s\",\n  \"seconds\":%.2f,\n  \"results\":[\n",impl,seconds);
+    for(f=0;f<sizeof(formats)/sizeof(formats[0]);f++) {
+        for(s=0;s<sizeof(sizes)/sizeof(sizes[0]);s++) {
+            for(mode=1;mode>=0;mode--) {
+                if(bench_run(out,formats[f],sizes[s][0],sizes[s][1],mode,(int64_t)(seconds * 1e6),first) < 0)
+                    status = 1;
+                else
+                    first = 0;
+            }
+        }
+    }
+    fprintf(out,"\n  ]\n}\n");
+    fclose(out);
+    return status;
+}
+#endif
@@ -1,7 +1,36 @@
 #ifndef UVC_CONTROL_H
 #define UVC_CONTROL_H
 
-typedef void (*uvcctl_callback_type)(void *user_data,int frame_no,char const *data,int width,int height,int bytes_per_pixel,char const *error_message);
+#include <stdint.h>
+
+// stream formats, frames are delivered as RGB24 for YUYV and MJPEG, 8 bit or 16 bit little endian mono for Y8 and Y16
+#define UVCCTL_FORMAT_YUYV  0
+#define UVCCTL_FORMAT_MJPEG 1
+#define UVCCTL_FORMAT_Y8    2
+#define UVCCTL_FORMAT_Y16   3
+// RGB24 passed as is, provided only by virtual camera replaying RGB recordings
+#define UVCCTL_FORMAT_RGB   4
+
+// virtual camera flags, by default frames are paced by recorded timestamps or frame rate
+#define UVCCTL_VIRTUAL_BENCHMARK 1  // deliver frames as fast as possible
+#define UVCCTL_VIRTUAL_LOOP      2  // restart from the first frame at the end of file, otherwise the
+                                    // callback gets a failed frame and acquire returns -1 there
+
+// camera controls in effect, values are -1 until set with uvcctl_set_* calls
+typedef struct uvcctl_controls {
+    int auto_mode;
+    float exposure_ms;
+    float gain;
+    int wb_temperature;
+    float gamma;
+    int generation;  // incremented on each applied change
+} uvcctl_controls;
+
+// timestamp_us - capture time in microseconds since Unix epoch, as reported by USB stack when the frame was completed
+// skipped - number of frames lost since previously delivered one, dropped or failed, see uvcctl_stats
+// controls - control values applied before the exposure of the frame started
+typedef void (*uvcctl_callback_type)(void *user_data,int frame_no,char const *data,int width,int height,int bytes_per_pixel,
+                                     int64_t timestamp_us,int skipped,uvcctl_controls const *controls,char const *error_message);
 typedef struct uvcctl uvcctl;
 
 typedef struct uvcctl_control_limits {
@@ -14,22 +43,116 @@ typedef struct uvcctl_control_limits {
     float gamma_cur;
 } uvcctl_control_limits;
 
+typedef struct uvcctl_frame {
+    int frame_no;
+    char const *data;
+    int width;
+    int height;
+    int bytes_per_pixel;
+    int64_t timestamp_us;
+    int skipped;
+    uvcctl_controls controls;
+    int buffer_id;
+} uvcctl_frame;
+
+typedef struct uvcctl_recorder_stats {
+    int frames_written;
+    int frames_dropped;
+    int queue_size;
+    int queue_high_water;
+    int write_stalls;
+    int failed;
+} uvcctl_recorder_stats;
+
+// histogram bin i counts durations of [2^(i-1),2^i) microseconds, bin 0 is below 1us, the last bin is open ended
+#define UVCCTL_HIST_BINS 20
+
+typedef struct uvcctl_stats {
+    int frames_received;    // frames completed by USB stack
+    int frames_delivered;
+    int frames_incomplete;  // USB side lost data, frame size does not match
+    int frames_dropped;     // no free buffer or decoder queue full - consumer is too slow
+    int frames_failed;      // unexpected format or decoding error
+    int transfer_retunes;   // stream restarts with more transfer buffers in automatic mode
+    int64_t bytes_received;
+    double convert_ms_avg;  // YUYV conversion, MJPEG decoding or copy
+    double convert_ms_max;
+    int convert_hist[UVCCTL_HIST_BINS];
+    int latency_hist[UVCCTL_HIST_BINS];  // capture to callback return, or to uvcctl_acquire_frame in pull mode
+} uvcctl_stats;
+
+// USB bandwidth of all devices opened by the process, compare with bus capacity,
+// about 40MB/s for USB 2.0 high speed, to see if it is oversubscribed
+typedef struct uvcctl_bandwidth {
+    int devices;
+    int streams;
+    double required_mb_per_sec;  // negotiated maximal frame size times frame rate
+    double measured_mb_per_sec;  // payload received since streams started
+} uvcctl_bandwidth;
+
+// any number of devices may be open at once, they share libusb context and USB event thread
 uvcctl *uvcctl_create();
+// camera replaying a file instead of USB device, fd of uvcctl_open is ignored and controls are no-op.
+// source is SER file, raw frames file in size and format of uvcctl_set_size or "synthetic" for generated frames.
+// Raw and synthetic sources are opened by uvcctl_start_stream, so the size may be set after uvcctl_open
+uvcctl *uvcctl_create_virtual(char const *source,int flags);
 char const *uvcctl_error(uvcctl *obj);
 int uvcctl_open_fd(char const *path);
 void uvcctl_close_fd(int fd);
+// controls are applied asynchronously by a worker thread that keeps only the latest
+// pending value of each control, failure is reported by the next call or uvcctl_flush_controls
 int uvcctl_auto_mode(uvcctl *obj,int is_auto);
+// limits are read once from the device and cached
 int uvcctl_get_control_limits(uvcctl *obj,uvcctl_control_limits *limits);
 int uvcctl_set_gain(uvcctl *obj,double range);
 int uvcctl_set_gamma(uvcctl *obj,double value);
 int uvcctl_set_exposure(uvcctl *obj,double exp_ms);
 int uvcctl_set_wb(uvcctl *obj,int temperature);
+// waits until all queued controls are applied
+int uvcctl_flush_controls(uvcctl *obj);
+// values applied so far
+void uvcctl_get_controls(uvcctl *obj,uvcctl_controls *controls);
+// returns MJPEG frame sizes
 int uvcctl_open(uvcctl *obj,int fd,int *sizes,int n);
-void uvcctl_set_size(uvcctl *obj,int w,int h,int compressed);
+// frame sizes of one of UVCCTL_FORMAT_*, returns number of width,height pairs written
+int uvcctl_get_sizes(uvcctl *obj,int format,int *sizes,int n);
+// format is one of UVCCTL_FORMAT_*, 0/1 keep old uncompressed/compressed meaning
+void uvcctl_set_size(uvcctl *obj,int w,int h,int format);
+// USB transfer buffers count and size in bytes. If either is 0 (default) they are chosen from negotiated
+// payload size, frame size and rate, and the stream is restarted with more buffers if frames arrive incomplete
 void uvcctl_set_buffers(uvcctl *obj,int N,int size);
+// transfer buffers used by current or last stream
+void uvcctl_get_buffers(uvcctl *obj,int *N,int *size);
+// number of RGB frame buffers allocated by uvcctl_start_stream, 1 to 16, default 4
+void uvcctl_set_pool_size(uvcctl *obj,int N);
+// pull mode delivers only the newest complete frame, pending frame is replaced by a newer one
+// and skipped field of uvcctl_frame counts frames the consumer never saw. At least 3 buffers are used
+void uvcctl_set_latest_only(uvcctl *obj,int enable);
+// MJPEG streams are decoded by a pool of threads, frames are still delivered in order.
+// queue_depth up to 16 frames, each frame in decoding holds a pool buffer. Default 2 threads, depth 3
+void uvcctl_set_mjpeg_decoders(uvcctl *obj,int threads,int queue_depth);
+// if callback is NULL frames are queued for uvcctl_read_frame/uvcctl_acquire_frame
+// if pool is exhausted the frame is dropped rather than blocking USB thread
 int uvcctl_start_stream(uvcctl *obj,uvcctl_callback_type callback,void *user_data);
-int uvcctl_read_frame(uvcctl *obj,int timeout,int w,int h,char *buffer);
+// copies frame to buffer, if info is not NULL it receives frame properties, data is set to NULL.
+// returns frame number, 0 on timeout and -1 on error
+int uvcctl_read_frame(uvcctl *obj,int timeout,int w,int h,char *buffer,uvcctl_frame *info);
+// zero copy read, returns 1 on frame, 0 on timeout, -1 on error. Frame must be returned with uvcctl_release_frame
+int uvcctl_acquire_frame(uvcctl *obj,int timeout,uvcctl_frame *frame);
+void uvcctl_release_frame(uvcctl *obj,uvcctl_frame const *frame);
+int uvcctl_get_dropped_frames(uvcctl *obj);
+// statistics since uvcctl_start_stream
+void uvcctl_get_stats(uvcctl *obj,uvcctl_stats *stats);
+// consumers blocked in uvcctl_read_frame/uvcctl_acquire_frame return -1, blocks until acquired
+// frames are released so it must not be called from the thread holding one
 int uvcctl_stop_stream(uvcctl *obj);
+// records delivered frames (RGB24 or mono) to SER file with per frame timestamps,
+// queue_frames - size of the buffer between USB side and writer thread, 0 for default
+int uvcctl_start_recording(uvcctl *obj,char const *path,int queue_frames);
+int uvcctl_stop_recording(uvcctl *obj);
+void uvcctl_get_recorder_stats(uvcctl *obj,uvcctl_recorder_stats *stats);
+// stops the stream, closes the device and frees obj
 void uvcctl_delete(uvcctl *obj);
+void uvcctl_get_bandwidth(uvcctl_bandwidth *bw);
 
 #endif
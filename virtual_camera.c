@@ -0,0 +1,448 @@
+#include "virtual_camera.h"
+#include "uvc_control.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <jpeglib.h>
+
+#define VIRTUAL_SER 0
+#define VIRTUAL_RAW 1
+#define VIRTUAL_SYNTHETIC 2
+
+#define SER_HEADER_SIZE 178
+#define DEFAULT_FPS 30
+// sleeps are split so stop request is handled even for long gaps in a recording
+#define MAX_SLEEP_NS 100000000LL
+// synthetic image is larger than the frame by this margin on each side and
+// moved by up to 3/4 of it, known shift is handy for testing registration
+#define SYNTHETIC_MARGIN 16
+#define SYNTHETIC_JPEG_QUALITY 85
+
+static int const format_frame_bytes[] = { 2, 0, 1, 2, 3 };  // per pixel as sent by camera, indexed by UVCCTL_FORMAT_*
+static enum uvc_frame_format const frame_formats[] = {
+    UVC_FRAME_FORMAT_YUYV, UVC_FRAME_FORMAT_MJPEG, UVC_FRAME_FORMAT_GRAY8, UVC_FRAME_FORMAT_GRAY16, UVC_FRAME_FORMAT_RGB
+};
+
+static int64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t get_le(unsigned char const *p,int bytes)
+{
+    uint64_t v = 0;
+    int i;
+    for(i=bytes-1;i>=0;i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static int read_all(int fd,void *data,size_t size,off_t offset)
+{
+    char *p = (char *)data;
+    while(size > 0) {
+        ssize_t n = pread(fd,p,size,offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+void virtual_camera_init(virtual_camera *v,char const *source,int flags)
+{
+    memset(v,0,sizeof(*v));
+    v->fd = -1;
+    v->flags = flags;
+    strncpy(v->source,source ? source : "synthetic",VIRTUAL_SOURCE_SIZE - 1);
+}
+
+static int open_ser(virtual_camera *v,off_t file_size,char *error,size_t error_size)
+{
+    unsigned char header[SER_HEADER_SIZE];
+    if(read_all(v->fd,header,sizeof(header),0) < 0) {
+        snprintf(error,error_size,"Failed to read SER header of %s",v->source);
+        return -1;
+    }
+    int color_id = get_le(header + 18,4);
+    int bits = get_le(header + 34,4);
+    v->width = get_le(header + 26,4);
+    v->height = get_le(header + 30,4);
+    v->frames_N = get_le(header + 38,4);
+    // 16 bit data is assumed to be little endian, writers disagree on the meaning of the endianness field
+    if(color_id == 0)
+        v->format = bits <= 8 ? UVCCTL_FORMAT_Y8 : UVCCTL_FORMAT_Y16;
+    else if(color_id == 100 && bits <= 8)
+        v->format = UVCCTL_FORMAT_RGB;
+    else {
+        snprintf(error,error_size,"Unsupported SER color %d with %d bits, only mono and RGB24 are supported",color_id,bits);
+        return -1;
+    }
+    v->data_offset = SER_HEADER_SIZE;
+    v->frame_size = (size_t)v->width * v->height * format_frame_bytes[v->format];
+    off_t data_end = SER_HEADER_SIZE + (off_t)v->frame_size * v->frames_N;
+    if(v->width <= 0 || v->height <= 0 || v->frames_N <= 0 || file_size < data_end) {
+        snprintf(error,error_size,"Invalid or truncated SER file %s",v->source);
+        return -1;
+    }
+    if(file_size >= data_end + 8 * (off_t)v->frames_N) {
+        v->timestamps = (int64_t *)malloc(sizeof(int64_t) * v->frames_N);
+        if(!v->timestamps || read_all(v->fd,v->timestamps,sizeof(int64_t) * v->frames_N,data_end) < 0) {
+            free(v->timestamps);
+            v->timestamps = NULL;
+        }
+        else {
+            int i;
+            for(i=0;i<v->frames_N;i++) {
+                v->timestamps[i] = get_le((unsigned char *)(v->timestamps + i),8);
+                // not usable for pacing, fall back to fps
+                if(i > 0 && v->timestamps[i] < v->timestamps[i-1]) {
+                    free(v->timestamps);
+                    v->timestamps = NULL;
+                    break;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static int open_raw(virtual_camera *v,off_t file_size,char *error,size_t error_size)
+{
+    v->data_offset = 0;
+    v->frame_size = (size_t)v->width * v->height * format_frame_bytes[v->format];
+    v->frames_N = file_size / v->frame_size;
+    if(v->frames_N == 0) {
+        snprintf(error,error_size,"Raw file %s does not contain a single %dx%d frame",v->source,v->width,v->height);
+        return -1;
+    }
+    return 0;
+}
+
+static void put_synthetic_pixel(virtual_camera *v,unsigned char *p,int x,int y,int value,int inside)
+{
+    unsigned noise = (x * 73856093u) ^ (y * 19349663u);
+    noise = (noise ^ (noise >> 13)) * 0x5bd1e995u;
+    noise ^= noise >> 15;
+    switch(v->format) {
+    case UVCCTL_FORMAT_YUYV:
+        p[0] = value;
+        p[1] = inside ? ((x & 1) ? 142 : 118) : 128;  // U for even pixel, V for odd
+        break;
+    case UVCCTL_FORMAT_Y8:
+        p[0] = value;
+        break;
+    case UVCCTL_FORMAT_Y16:
+        p[0] = noise & 0xFF;
+        p[1] = value;
+        break;
+    default:
+        p[0] = value;
+        p[1] = value * 9 / 10;
+        p[2] = value * 7 / 10;
+    }
+}
+
+// MJPEG frames are compressed from RGB image
+static int synthetic_bpp(virtual_camera *v)
+{
+    return v->format == UVCCTL_FORMAT_MJPEG ? 3 : format_frame_bytes[v->format];
+}
+
+static void synthetic_crop(virtual_camera *v,int n,unsigned char *out)
+{
+    int bpp = synthetic_bpp(v);
+    int row = v->width * bpp;
+    int dx = SYNTHETIC_MARGIN + (int)lrintf(SYNTHETIC_MARGIN * 0.75f * cosf(n * 0.05f));
+    int dy = SYNTHETIC_MARGIN + (int)lrintf(SYNTHETIC_MARGIN * 0.75f * sinf(n * 0.07f));
+    int y;
+    dx &= ~1;  // keep YUYV pairs aligned
+    for(y=0;y<v->height;y++)
+        memcpy(out + (size_t)row * y,v->synthetic + (size_t)v->synthetic_stride * (y + dy) + dx * bpp,row);
+}
+
+static int encode_synthetic(virtual_camera *v,char *error,size_t error_size)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    unsigned char *rgb = (unsigned char *)malloc((size_t)v->width * v->height * 3);
+    int i,y;
+    if(!rgb) {
+        snprintf(error,error_size,"Failed to allocate synthetic image %dx%d",v->width,v->height);
+        return -1;
+    }
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    v->frame_size = 0;
+    for(i=0;i<VIRTUAL_JPEG_FRAMES;i++) {
+        synthetic_crop(v,i,rgb);
+        jpeg_mem_dest(&cinfo,&v->jpeg[i],&v->jpeg_size[i]);
+        cinfo.image_width = v->width;
+        cinfo.image_height = v->height;
+        cinfo.input_components = 3;
+        cinfo.in_color_space = JCS_RGB;
+        jpeg_set_defaults(&cinfo);
+        jpeg_set_quality(&cinfo,SYNTHETIC_JPEG_QUALITY,TRUE);
+        jpeg_start_compress(&cinfo,TRUE);
+        for(y=0;y<v->height;y++) {
+            JSAMPROW row = rgb + (size_t)y * v->width * 3;
+            jpeg_write_scanlines(&cinfo,&row,1);
+        }
+        jpeg_finish_compress(&cinfo);
+        if(v->jpeg_size[i] > v->frame_size)
+            v->frame_size = v->jpeg_size[i];
+    }
+    jpeg_destroy_compress(&cinfo);
+    free(rgb);
+    return 0;
+}
+
+static int open_synthetic(virtual_camera *v,char *error,size_t error_size)
+{
+    int bpp = synthetic_bpp(v);
+    int w = v->width + 2 * SYNTHETIC_MARGIN;
+    int h = v->height + 2 * SYNTHETIC_MARGIN;
+    int x,y;
+    v->frames_N = -1;
+    v->frame_size = (size_t)v->width * v->height * bpp;
+    v->synthetic_stride = w * bpp;
+    v->synthetic = (unsigned char *)malloc((size_t)v->synthetic_stride * h);
+    if(!v->synthetic) {
+        snprintf(error,error_size,"Failed to allocate synthetic image %dx%d",w,h);
+        return -1;
+    }
+    // banded planet with limb darkening over noisy background
+    float r = (v->width < v->height ? v->width : v->height) / 5.0f;
+    for(y=0;y<h;y++) {
+        for(x=0;x<w;x++) {
+            float dx = x - w * 0.5f;
+            float dy = y - h * 0.5f;
+            float d2 = (dx*dx + dy*dy) / (r*r);
+            unsigned noise = (x * 2654435761u) ^ (y * 40503u);
+            int value = 12 + ((noise >> 7) & 7);
+            int inside = d2 < 1.0f;
+            if(inside)
+                value = 40 + 180 * sqrtf(1.0f - d2) * (0.85f + 0.15f * sinf(dy * 12.0f / r));
+            put_synthetic_pixel(v,v->synthetic + (size_t)y * v->synthetic_stride + x * bpp,x,y,value,inside);
+        }
+    }
+    if(v->format == UVCCTL_FORMAT_MJPEG)
+        return encode_synthetic(v,error,error_size);
+    return 0;
+}
+
+int virtual_camera_is_ser(virtual_camera const *v)
+{
+    char magic[14];
+    int res;
+    if(strcmp(v->source,"synthetic") == 0)
+        return 0;
+    int fd = open(v->source,O_RDONLY);
+    if(fd < 0)
+        return 0;
+    res = read_all(fd,magic,sizeof(magic),0) == 0 && memcmp(magic,"LUCAM-RECORDER",14) == 0;
+    close(fd);
+    return res;
+}
+
+int virtual_camera_open(virtual_camera *v,int width,int height,int format,char *error,size_t error_size)
+{
+    off_t file_size = 0;
+    virtual_camera_close(v);
+    v->width = width;
+    v->height = height;
+    v->format = format;
+    v->fps = DEFAULT_FPS;
+    v->type = strcmp(v->source,"synthetic") == 0 ? VIRTUAL_SYNTHETIC : VIRTUAL_RAW;
+    if(v->type != VIRTUAL_SYNTHETIC) {
+        struct stat st;
+        char magic[14];
+        v->fd = open(v->source,O_RDONLY);
+        if(v->fd < 0 || fstat(v->fd,&st) < 0) {
+            snprintf(error,error_size,"Failed to open %s: %s",v->source,strerror(errno));
+            virtual_camera_close(v);
+            return -1;
+        }
+        file_size = st.st_size;
+        if(read_all(v->fd,magic,sizeof(magic),0) == 0 && memcmp(magic,"LUCAM-RECORDER",14) == 0)
+            v->type = VIRTUAL_SER;
+    }
+    int res;
+    if(v->type == VIRTUAL_SER) {
+        res = open_ser(v,file_size,error,error_size);
+    }
+    else if(v->format < 0 || v->format > UVCCTL_FORMAT_RGB || (v->format == UVCCTL_FORMAT_MJPEG && v->type != VIRTUAL_SYNTHETIC)) {
+        snprintf(error,error_size,"Virtual camera does not support format %d",v->format);
+        res = -1;
+    }
+    else if(v->width <= 0 || v->height <= 0 || (v->format == UVCCTL_FORMAT_YUYV && v->width % 2 != 0)) {
+        snprintf(error,error_size,"Invalid virtual frame size %dx%d",v->width,v->height);
+        res = -1;
+    }
+    else if(v->type == VIRTUAL_RAW) {
+        res = open_raw(v,file_size,error,error_size);
+    }
+    else {
+        res = open_synthetic(v,error,error_size);
+    }
+    if(res < 0) {
+        virtual_camera_close(v);
+        return -1;
+    }
+    v->frame = (unsigned char *)malloc(v->frame_size);
+    if(!v->frame) {
+        snprintf(error,error_size,"Failed to allocate virtual frame %dx%d",v->width,v->height);
+        virtual_camera_close(v);
+        return -1;
+    }
+    if(v->timestamps && v->frames_N > 1) {
+        int64_t duration = v->timestamps[v->frames_N - 1] - v->timestamps[0];
+        if(duration > 0)
+            v->fps = (int)((v->frames_N - 1) * 10000000LL / duration);
+        if(v->fps <= 0)
+            v->fps = 1;
+    }
+    return 0;
+}
+
+static int load_frame(virtual_camera *v,int n)
+{
+    v->data_bytes = v->frame_size;
+    if(v->type != VIRTUAL_SYNTHETIC)
+        return read_all(v->fd,v->frame,v->frame_size,v->data_offset + (off_t)v->frame_size * n);
+    if(v->format == UVCCTL_FORMAT_MJPEG) {
+        int k = n % VIRTUAL_JPEG_FRAMES;
+        memcpy(v->frame,v->jpeg[k],v->jpeg_size[k]);
+        v->data_bytes = v->jpeg_size[k];
+        return 0;
+    }
+    synthetic_crop(v,n,v->frame);
+    return 0;
+}
+
+// offset of frame n from the start of the playback
+static int64_t frame_offset_ns(virtual_camera *v,int n)
+{
+    if(v->timestamps)
+        return (v->timestamps[n] - v->timestamps[0]) * 100;
+    return (int64_t)n * 1000000000 / v->fps;
+}
+
+static void sleep_until(virtual_camera *v,int64_t target)
+{
+    while(!v->stop) {
+        int64_t left = target - monotonic_ns();
+        if(left <= 0)
+            break;
+        if(left > MAX_SLEEP_NS)
+            left = MAX_SLEEP_NS;
+        struct timespec ts = { left / 1000000000, left % 1000000000 };
+        nanosleep(&ts,NULL);
+    }
+}
+
+static void *replay_thread(void *ptr)
+{
+    virtual_camera *v = (virtual_camera *)ptr;
+    int64_t start = monotonic_ns();
+    uint32_t sequence = 0;
+    int n = 0;
+    char const *end = NULL;
+    while(!v->stop) {
+        if(v->frames_N >= 0 && n >= v->frames_N) {
+            if(!(v->flags & UVCCTL_VIRTUAL_LOOP)) {
+                end = "End of recording";
+                break;
+            }
+            start += frame_offset_ns(v,v->frames_N - 1) + 1000000000 / v->fps;
+            n = 0;
+        }
+        int ok = load_frame(v,n) == 0;
+        if(!(v->flags & UVCCTL_VIRTUAL_BENCHMARK))
+            sleep_until(v,start + (v->frames_N >= 0 ? frame_offset_ns(v,n) : (int64_t)sequence * 1000000000 / v->fps));
+        if(v->stop)
+            break;
+
+        uvc_frame_t frame;
+        struct timespec now,mono;
+        memset(&frame,0,sizeof(frame));
+        clock_gettime(CLOCK_REALTIME,&now);
+        clock_gettime(CLOCK_MONOTONIC,&mono);
+        frame.data = v->frame;
+        frame.data_bytes = ok ? v->data_bytes : 0;  // reported as incomplete frame
+        frame.width = v->width;
+        frame.height = v->height;
+        frame.frame_format = frame_formats[v->format];
+        frame.step = v->width * format_frame_bytes[v->format];
+        frame.sequence = sequence++;
+        frame.capture_time.tv_sec = now.tv_sec;
+        frame.capture_time.tv_usec = now.tv_nsec / 1000;
+        frame.capture_time_finished = mono;  // same clock as libuvc
+        v->callback(&frame,v->user_data);
+        if(!ok) {
+            end = "Failed to read recording";
+            break;
+        }
+        n++;
+    }
+    if(end && v->end_callback)
+        v->end_callback(v->user_data,end);
+    return NULL;
+}
+
+int virtual_camera_start(virtual_camera *v,uvc_frame_callback_t *callback,virtual_camera_end_type end_callback,void *user_data)
+{
+    if(v->running || !v->frame)
+        return -1;
+    v->callback = callback;
+    v->end_callback = end_callback;
+    v->user_data = user_data;
+    v->stop = 0;
+    if(pthread_create(&v->thread,NULL,replay_thread,v) != 0)
+        return -1;
+    v->running = 1;
+    return 0;
+}
+
+void virtual_camera_stop(virtual_camera *v)
+{
+    if(!v->running)
+        return;
+    v->stop = 1;
+    pthread_join(v->thread,NULL);
+    v->running = 0;
+}
+
+void virtual_camera_close(virtual_camera *v)
+{
+    int i;
+    virtual_camera_stop(v);
+    if(v->fd >= 0) {
+        close(v->fd);
+        v->fd = -1;
+    }
+    free(v->timestamps);
+    free(v->frame);
+    free(v->synthetic);
+    for(i=0;i<VIRTUAL_JPEG_FRAMES;i++) {
+        free(v->jpeg[i]);
+        v->jpeg[i] = NULL;
+        v->jpeg_size[i] = 0;
+    }
+    v->timestamps = NULL;
+    v->frame = NULL;
+    v->synthetic = NULL;
+}
@@ -0,0 +1,59 @@
+#ifndef VIRTUAL_CAMERA_H
+#define VIRTUAL_CAMERA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "libuvc/libuvc.h"
+
+#define VIRTUAL_SOURCE_SIZE 256
+// synthetic MJPEG cycles over pre-encoded frames, compression is not part of the measured path
+#define VIRTUAL_JPEG_FRAMES 16
+
+// called from replay thread once a source that does not loop has no more frames or can't be
+// read, message tells which
+typedef void (*virtual_camera_end_type)(void *user_data,char const *message);
+
+//
+// Replays recorded SER files, raw YUYV dumps or synthetic frames (including MJPEG) through
+// the same frame callback libuvc would call, from its own thread
+//
+typedef struct virtual_camera {
+    char source[VIRTUAL_SOURCE_SIZE];
+    int flags;
+    int type;
+    int fd;
+    int width;
+    int height;
+    int format;
+    int fps;
+    size_t frame_size;
+    size_t data_offset;
+    int frames_N;
+    int64_t *timestamps;
+    unsigned char *frame;
+    unsigned char *synthetic;
+    int synthetic_stride;
+    unsigned char *jpeg[VIRTUAL_JPEG_FRAMES];
+    unsigned long jpeg_size[VIRTUAL_JPEG_FRAMES];
+    size_t data_bytes;
+    uvc_frame_callback_t *callback;
+    virtual_camera_end_type end_callback;
+    void *user_data;
+    pthread_t thread;
+    int running;                // replay thread is to be joined, stays set after the source ended
+    volatile int stop;
+} virtual_camera;
+
+void virtual_camera_init(virtual_camera *v,char const *source,int flags);
+// SER files define frame size and format, other sources take them from virtual_camera_open
+int virtual_camera_is_ser(virtual_camera const *v);
+// width, height and UVCCTL_FORMAT_* format are used for raw files and synthetic source, SER files
+// define their own. Returns -1 and fills error on failure
+int virtual_camera_open(virtual_camera *v,int width,int height,int format,char *error,size_t error_size);
+// end_callback may be NULL
+int virtual_camera_start(virtual_camera *v,uvc_frame_callback_t *callback,virtual_camera_end_type end_callback,void *user_data);
+void virtual_camera_stop(virtual_camera *v);
+void virtual_camera_close(virtual_camera *v);
+
+#endif
@@ -0,0 +1,299 @@
+#include "yuv2rgb.h"
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define YUV2RGB_X86
+#define TARGET_SSE4 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define YUV2RGB_NEON
+#if !defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+//
+// All paths use libuvc coefficients in Q14: r = (22987*v)>>14, g = (-5636*u - 11698*v)>>14, b = (29049*u)>>14
+// SIMD paths compute each product as high half of a 16 bit multiply with u,v pre-shifted by 2,
+// so r and b are bit exact and g may differ by 1 due to rounding of each term separately
+//
+
+static inline unsigned char sat(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+void yuyv2rgb_scalar(unsigned char const *src,unsigned char *dst,int pixels)
+{
+    int i;
+    for(i=0;i+2<=pixels;i+=2,src+=4,dst+=6) {
+        int u = src[1] - 128;
+        int v = src[3] - 128;
+        int r = (22987 * v) >> 14;
+        int g = (-5636 * u - 11698 * v) >> 14;
+        int b = (29049 * u) >> 14;
+        dst[0] = sat(src[0] + r);
+        dst[1] = sat(src[0] + g);
+        dst[2] = sat(src[0] + b);
+        dst[3] = sat(src[2] + r);
+        dst[4] = sat(src[2] + g);
+        dst[5] = sat(src[2] + b);
+    }
+}
+
+static int always_supported(void)
+{
+    return 1;
+}
+
+#ifdef YUV2RGB_X86
+
+// 8 pixels of YUYV to 16 bit R,G,B
+TARGET_SSE4 static inline void sse_rgb16(__m128i in,__m128i *r,__m128i *g,__m128i *b)
+{
+    __m128i y  = _mm_and_si128(in,_mm_set1_epi16(0xFF));
+    __m128i uv = _mm_slli_epi16(_mm_sub_epi16(_mm_srli_epi16(in,8),_mm_set1_epi16(128)),2);
+    __m128i u  = _mm_shuffle_epi8(uv,_mm_setr_epi8(0,1,0,1,4,5,4,5,8,9,8,9,12,13,12,13));
+    __m128i v  = _mm_shuffle_epi8(uv,_mm_setr_epi8(2,3,2,3,6,7,6,7,10,11,10,11,14,15,14,15));
+    *r = _mm_add_epi16(y,_mm_mulhi_epi16(v,_mm_set1_epi16(22987)));
+    *g = _mm_add_epi16(y,_mm_add_epi16(_mm_mulhi_epi16(u,_mm_set1_epi16(-5636)),_mm_mulhi_epi16(v,_mm_set1_epi16(-11698))));
+    *b = _mm_add_epi16(y,_mm_mulhi_epi16(u,_mm_set1_epi16(29049)));
+}
+
+// interleaves 16 bytes of each R,G,B plane into 48 bytes of RGB24
+TARGET_SSE4 static inline void sse_store_rgb(unsigned char *dst,__m128i r,__m128i g,__m128i b)
+{
+    __m128i o0 = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(r,_mm_setr_epi8(0,-128,-128,1,-128,-128,2,-128,-128,3,-128,-128,4,-128,-128,5)),
+        _mm_shuffle_epi8(g,_mm_setr_epi8(-128,0,-128,-128,1,-128,-128,2,-128,-128,3,-128,-128,4,-128,-128))),
+        _mm_shuffle_epi8(b,_mm_setr_epi8(-128,-128,0,-128,-128,1,-128,-128,2,-128,-128,3,-128,-128,4,-128)));
+    __m128i o1 = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(r,_mm_setr_epi8(-128,-128,6,-128,-128,7,-128,-128,8,-128,-128,9,-128,-128,10,-128)),
+        _mm_shuffle_epi8(g,_mm_setr_epi8(5,-128,-128,6,-128,-128,7,-128,-128,8,-128,-128,9,-128,-128,10))),
+        _mm_shuffle_epi8(b,_mm_setr_epi8(-128,5,-128,-128,6,-128,-128,7,-128,-128,8,-128,-128,9,-128,-128)));
+    __m128i o2 = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(r,_mm_setr_epi8(-128,11,-128,-128,12,-128,-128,13,-128,-128,14,-128,-128,15,-128,-128)),
+        _mm_shuffle_epi8(g,_mm_setr_epi8(-128,-128,11,-128,-128,12,-128,-128,13,-128,-128,14,-128,-128,15,-128))),
+        _mm_shuffle_epi8(b,_mm_setr_epi8(10,-128,-128,11,-128,-128,12,-128,-128,13,-128,-128,14,-128,-128,15)));
+    _mm_storeu_si128((__m128i *)(dst),o0);
+    _mm_storeu_si128((__m128i *)(dst + 16),o1);
+    _mm_storeu_si128((__m128i *)(dst + 32),o2);
+}
+
+TARGET_SSE4 static void yuyv2rgb_sse4(unsigned char const *src,unsigned char *dst,int pixels)
+{
+    int i;
+    for(i=0;i+16<=pixels;i+=16,src+=32,dst+=48) {
+        __m128i ra,ga,ba,rb,gb,bb;
+        sse_rgb16(_mm_loadu_si128((__m128i const *)(src)),&ra,&ga,&ba);
+        sse_rgb16(_mm_loadu_si128((__m128i const *)(src + 16)),&rb,&gb,&bb);
+        sse_store_rgb(dst,_mm_packus_epi16(ra,rb),_mm_packus_epi16(ga,gb),_mm_packus_epi16(ba,bb));
+    }
+    yuyv2rgb_scalar(src,dst,pixels - i);
+}
+
+// 16 pixels of YUYV to 16 bit R,G,B, each 128 bit lane handles 8 pixels
+TARGET_AVX2 static inline void avx2_rgb16(__m256i in,__m256i *r,__m256i *g,__m256i *b)
+{
+    __m256i y  = _mm256_and_si256(in,_mm256_set1_epi16(0xFF));
+    __m256i uv = _mm256_slli_epi16(_mm256_sub_epi16(_mm256_srli_epi16(in,8),_mm256_set1_epi16(128)),2);
+    __m256i u  = _mm256_shuffle_epi8(uv,_mm256_setr_epi8(0,1,0,1,4,5,4,5,8,9,8,9,12,13,12,13,
+                                                         0,1,0,1,4,5,4,5,8,9,8,9,12,13,12,13));
+    __m256i v  = _mm256_shuffle_epi8(uv,_mm256_setr_epi8(2,3,2,3,6,7,6,7,10,11,10,11,14,15,14,15,
+                                                         2,3,2,3,6,7,6,7,10,11,10,11,14,15,14,15));
+    *r = _mm256_add_epi16(y,_mm256_mulhi_epi16(v,_mm256_set1_epi16(22987)));
+    *g = _mm256_add_epi16(y,_mm256_add_epi16(_mm256_mulhi_epi16(u,_mm256_set1_epi16(-5636)),_mm256_mulhi_epi16(v,_mm256_set1_epi16(-11698))));
+    *b = _mm256_add_epi16(y,_mm256_mulhi_epi16(u,_mm256_set1_epi16(29049)));
+}
+
+// packus works per lane, permute restores pixel order 0-7,8-15,16-23,24-31
+TARGET_AVX2 static inline __m256i avx2_pack(__m256i a,__m256i b)
+{
+    return _mm256_permute4x64_epi64(_mm256_packus_epi16(a,b),0xD8);
+}
+
+TARGET_AVX2 static void yuyv2rgb_avx2(unsigned char const *src,unsigned char *dst,int pixels)
+{
+    int i;
+    for(i=0;i+32<=pixels;i+=32,src+=64,dst+=96) {
+        __m256i ra,ga,ba,rb,gb,bb;
+        avx2_rgb16(_mm256_loadu_si256((__m256i const *)(src)),&ra,&ga,&ba);
+        avx2_rgb16(_mm256_loadu_si256((__m256i const *)(src + 32)),&rb,&gb,&bb);
+        __m256i r = avx2_pack(ra,rb);
+        __m256i g = avx2_pack(ga,gb);
+        __m256i b = avx2_pack(ba,bb);
+        sse_store_rgb(dst,     _mm256_castsi256_si128(r),     _mm256_castsi256_si128(g),     _mm256_castsi256_si128(b));
+        sse_store_rgb(dst + 48,_mm256_extracti128_si256(r,1),_mm256_extracti128_si256(g,1),_mm256_extracti128_si256(b,1));
+    }
+    yuyv2rgb_sse4(src,dst,pixels - i);
+}
+
+static int sse4_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.1");
+}
+
+static int avx2_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+#ifdef YUV2RGB_NEON
+
+// 8 pixels to R,G,B, vqdmulh gives (2*a*b)>>16 so u,v are pre-shifted by 1
+static inline uint8x8x3_t neon_rgb8(uint8x8_t y8,uint8x8_t u8,uint8x8_t v8)
+{
+    uint8x8x3_t res;
+    int16x8_t c128 = vdupq_n_s16(128);
+    int16x8_t y = vreinterpretq_s16_u16(vmovl_u8(y8));
+    int16x8_t u = vshlq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(u8)),c128),1);
+    int16x8_t v = vshlq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v8)),c128),1);
+    res.val[0] = vqmovun_s16(vaddq_s16(y,vqdmulhq_n_s16(v,22987)));
+    res.val[1] = vqmovun_s16(vaddq_s16(y,vaddq_s16(vqdmulhq_n_s16(u,-5636),vqdmulhq_n_s16(v,-11698))));
+    res.val[2] = vqmovun_s16(vaddq_s16(y,vqdmulhq_n_s16(u,29049)));
+    return res;
+}
+
+static void yuyv2rgb_neon(unsigned char const *src,unsigned char *dst,int pixels)
+{
+    int i;
+    for(i=0;i+16<=pixels;i+=16,src+=32,dst+=48) {
+        // val[0] - Y, val[1] - U0 V0 U1 V1 ...
+        uint8x16x2_t in = vld2q_u8(src);
+        // val[0] - U0 U0 U1 U1 ..., val[1] - V0 V0 V1 V1 ...
+        uint8x16x2_t uv = vtrnq_u8(in.val[1],in.val[1]);
+        uint8x8x3_t lo = neon_rgb8(vget_low_u8(in.val[0]), vget_low_u8(uv.val[0]), vget_low_u8(uv.val[1]));
+        uint8x8x3_t hi = neon_rgb8(vget_high_u8(in.val[0]),vget_high_u8(uv.val[0]),vget_high_u8(uv.val[1]));
+        uint8x16x3_t out;
+        out.val[0] = vcombine_u8(lo.val[0],hi.val[0]);
+        out.val[1] = vcombine_u8(lo.val[1],hi.val[1]);
+        out.val[2] = vcombine_u8(lo.val[2],hi.val[2]);
+        vst3q_u8(dst,out);
+    }
+    yuyv2rgb_scalar(src,dst,pixels - i);
+}
+
+static int neon_supported(void)
+{
+#ifdef __aarch64__
+    return 1;
+#else
+    return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+}
+
+#endif
+
+typedef struct yuyv2rgb_impl {
+    char const *name;
+    yuyv2rgb_func func;
+    int (*supported)(void);
+} yuyv2rgb_impl;
+
+// in order of preference
+static yuyv2rgb_impl const implementations[] = {
+#ifdef YUV2RGB_X86
+    { "avx2", yuyv2rgb_avx2, avx2_supported },
+    { "sse4", yuyv2rgb_sse4, sse4_supported },
+#endif
+#ifdef YUV2RGB_NEON
+    { "neon", yuyv2rgb_neon, neon_supported },
+#endif
+    { "scalar", yuyv2rgb_scalar, always_supported },
+};
+
+yuyv2rgb_func yuyv2rgb_select(char const **name)
+{
+    size_t i;
+    for(i=0;i<sizeof(implementations)/sizeof(implementations[0]);i++) {
+        if(implementations[i].supported()) {
+            if(name)
+                *name = implementations[i].name;
+            return implementations[i].func;
+        }
+    }
+    if(name)
+        *name = "scalar";
+    return yuyv2rgb_scalar;
+}
+
+static yuyv2rgb_func selected_impl;
+
+void yuyv2rgb(unsigned char const *yuyv,unsigned char *rgb,int pixels)
+{
+    // selection is idempotent so concurrent first calls are harmless
+    yuyv2rgb_func f = __atomic_load_n(&selected_impl,__ATOMIC_RELAXED);
+    if(!f) {
+        f = yuyv2rgb_select(NULL);
+        __atomic_store_n(&selected_impl,f,__ATOMIC_RELAXED);
+    }
+    f(yuyv,rgb,pixels);
+}
+
+#ifdef INCLUDE_MAIN
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc,char **argv)
+{
+    int w = argc >= 3 ? atoi(argv[1]) : 1280;
+    int h = argc >= 3 ? atoi(argv[2]) : 720;
+    int iterations = argc >= 4 ? atoi(argv[3]) : 200;
+    int pixels = w*h;
+    unsigned char *src = malloc(pixels * 2);
+    unsigned char *ref = malloc(pixels * 3);
+    unsigned char *out = malloc(pixels * 3);
+    size_t i,j;
+    char const *best = NULL;
+    if(!src || !ref || !out)
+        return 1;
+    for(j=0;j<(size_t)pixels*2;j++)
+        src[j] = rand();
+    yuyv2rgb_scalar(src,ref,pixels);
+    yuyv2rgb_select(&best);
+    printf("%dx%d, %d iterations, selected %s\n",w,h,iterations,best);
+    for(i=0;i<sizeof(implementations)/sizeof(implementations[0]);i++) {
+        yuyv2rgb_impl const *impl = &implementations[i];
+        if(!impl->supported()) {
+            printf("%-8s not supported\n",impl->name);
+            continue;
+        }
+        memset(out,0,pixels * 3);
+        impl->func(src,out,pixels);
+        int max_diff = 0;
+        for(j=0;j<(size_t)pixels*3;j++) {
+            int d = abs(out[j] - ref[j]);
+            if(d > max_diff)
+                max_diff = d;
+        }
+        double start = now();
+        int k;
+        for(k=0;k<iterations;k++)
+            impl->func(src,out,pixels);
+        double passed = now() - start;
+        printf("%-8s %8.1f MPix/s max diff %d\n",impl->name,(double)pixels * iterations / passed * 1e-6,max_diff);
+    }
+    free(src);
+    free(ref);
+    free(out);
+    return 0;
+}
+#endif
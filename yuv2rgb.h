@@ -0,0 +1,21 @@
+#ifndef YUV2RGB_H
+#define YUV2RGB_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// converts pixels (must be even) of packed YUYV to RGB24, same integer math as libuvc uvc_yuyv2rgb
+typedef void (*yuyv2rgb_func)(unsigned char const *yuyv,unsigned char *rgb,int pixels);
+
+void yuyv2rgb_scalar(unsigned char const *yuyv,unsigned char *rgb,int pixels);
+
+// best implementation for running CPU, detected once
+yuyv2rgb_func yuyv2rgb_select(char const **name);
+void yuyv2rgb(unsigned char const *yuyv,unsigned char *rgb,int pixels);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif